@@ -0,0 +1,324 @@
+/******************************************************************************
+ *   Copyright (C) 2020 by Arkadiusz Hiler
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+/* Runs a plugin through LV2Rack the way OBS would, on synthetic audio, and
+ * reports how fast it goes, how long each block takes and whether anything
+ * gets allocated on the audio thread. Needs no OBS, no display and no UI.
+ *
+ *   obs-lv2-bench [-b 64,256,1024] [-r 48000] [-c 2] [-d 10] [-f 0]
+ *                 [-s state | -s @file] <plugin uri>
+ */
+
+#include "obs-lv2.hpp"
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <malloc.h>
+#include <unistd.h>
+
+/* exit code for meson to report the benchmark as skipped */
+#define EXIT_SKIP 77
+
+/* COUNTING ALLOCATIONS - everything, operator new included, ends up in
+ * malloc. glibc only, which is what OBS runs on for LV2 anyway. */
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void *__libc_memalign(size_t align, size_t size);
+
+static thread_local bool counting = false;
+static uint64_t allocations = 0;
+
+extern "C" void *malloc(size_t size)
+{
+	if (counting)
+		allocations++;
+
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+	if (counting)
+		allocations++;
+
+	return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	if (counting)
+		allocations++;
+
+	return __libc_realloc(ptr, size);
+}
+
+extern "C" void *memalign(size_t align, size_t size)
+{
+	if (counting)
+		allocations++;
+
+	return __libc_memalign(align, size);
+}
+
+extern "C" int posix_memalign(void **ptr, size_t align, size_t size)
+{
+	if (counting)
+		allocations++;
+
+	*ptr = __libc_memalign(align, size);
+
+	return *ptr != nullptr ? 0 : ENOMEM;
+}
+
+extern "C" void *aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align, size);
+}
+
+struct BenchConfig
+{
+	std::vector<int> block_sizes { 64, 256, 1024 };
+	uint32_t sample_rate = 48000;
+	size_t channels = 2;
+	double duration = 10.0;
+	size_t fixed_block = 0;
+	std::string state;
+	const char *uri = nullptr;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options] <plugin uri>\n"
+		"  -b sizes   comma separated block sizes to feed, default 64,256,1024\n"
+		"  -r rate    sample rate, default 48000\n"
+		"  -c count   channels, default 2\n"
+		"  -d seconds of audio per block size, default 10\n"
+		"  -f frames  the rack's fixed processing block, default 0 (none)\n"
+		"  -s state   plugin state as saved by the filter, @file to read it\n",
+		name);
+}
+
+static bool parse_args(int argc, char **argv, BenchConfig &config)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:r:c:d:f:s:h")) != -1) {
+		switch (opt) {
+		case 'b': {
+			config.block_sizes.clear();
+			std::stringstream list(optarg);
+			std::string size;
+
+			while (std::getline(list, size, ','))
+				config.block_sizes.push_back(atoi(size.c_str()));
+			break;
+		}
+		case 'r':
+			config.sample_rate = strtoul(optarg, nullptr, 10);
+			break;
+		case 'c':
+			config.channels = strtoul(optarg, nullptr, 10);
+			break;
+		case 'd':
+			config.duration = atof(optarg);
+			break;
+		case 'f':
+			config.fixed_block = strtoul(optarg, nullptr, 10);
+			break;
+		case 's':
+			if (optarg[0] == '@') {
+				std::ifstream file(optarg + 1);
+				std::stringstream content;
+				content << file.rdbuf();
+				config.state = content.str();
+			} else {
+				config.state = optarg;
+			}
+			break;
+		default:
+			return false;
+		}
+	}
+
+	if (optind != argc - 1)
+		return false;
+
+	config.uri = argv[optind];
+
+	if (config.channels == 0 || config.channels > MAX_CHANNELS ||
+	    config.sample_rate == 0 || config.duration <= 0.0)
+		return false;
+
+	for (int size: config.block_sizes) {
+		if (size <= 0)
+			return false;
+	}
+
+	return true;
+}
+
+/* noise and a sweep, so nothing gets optimized for silence or denormals */
+static void generate(std::vector<std::vector<float>> &audio, uint32_t sample_rate)
+{
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> noise(-0.1f, 0.1f);
+	double phase = 0.0;
+
+	for (size_t i = 0; i < audio[0].size(); ++i) {
+		double freq = 20.0 + 10000.0 * i / audio[0].size();
+		phase += 2.0 * M_PI * freq / sample_rate;
+
+		for (size_t ch = 0; ch < audio.size(); ++ch)
+			audio[ch][i] = 0.5f * sin(phase + ch) + noise(rng);
+	}
+}
+
+static double percentile(std::vector<double> &sorted, double p)
+{
+	if (sorted.empty())
+		return 0.0;
+
+	size_t idx = std::min(sorted.size() - 1, (size_t) (p / 100.0 * sorted.size()));
+
+	return sorted[idx];
+}
+
+static void run(LV2Rack *rack, const BenchConfig &config, int block_size)
+{
+	size_t frames = std::max((size_t) (config.duration * config.sample_rate), (size_t) block_size);
+
+	std::vector<std::vector<float>> source(config.channels, std::vector<float>(frames));
+	std::vector<std::vector<float>> work(config.channels, std::vector<float>(frames));
+	generate(source, config.sample_rate);
+
+	/* the crossfade in from the dry signal and whatever the plugin does
+	 * on its first blocks are not what we are after */
+	for (int i = 0; i < 16; ++i) {
+		float *buf[MAX_CHANNELS] = {};
+
+		for (size_t ch = 0; ch < config.channels; ++ch) {
+			memcpy(work[ch].data(), source[ch].data(), block_size * sizeof(float));
+			buf[ch] = work[ch].data();
+		}
+
+		rack->process_frames(buf, block_size);
+	}
+
+	for (size_t ch = 0; ch < config.channels; ++ch)
+		work[ch] = source[ch];
+
+	std::vector<double> times;
+	times.reserve(frames / block_size + 1);
+
+	uint64_t allocating_blocks = 0;
+	allocations = 0;
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (size_t off = 0; off + block_size <= frames; off += block_size) {
+		float *buf[MAX_CHANNELS] = {};
+
+		for (size_t ch = 0; ch < config.channels; ++ch)
+			buf[ch] = work[ch].data() + off;
+
+		uint64_t before = allocations;
+		auto block_start = std::chrono::steady_clock::now();
+
+		counting = true;
+		rack->process_frames(buf, block_size);
+		counting = false;
+
+		auto block_end = std::chrono::steady_clock::now();
+		times.push_back(std::chrono::duration<double, std::micro>(block_end - block_start).count());
+
+		if (allocations != before)
+			allocating_blocks++;
+	}
+
+	double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double audio = (double) times.size() * block_size / config.sample_rate;
+	double budget = 1e6 * block_size / config.sample_rate;
+
+	std::sort(times.begin(), times.end());
+
+	printf("block %5d: %8.1fx realtime, %10.0f frames/s\n"
+	       "             per block (us): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f  (budget %.1f)\n"
+	       "             allocations on the audio thread: %lu in %lu of %zu blocks\n",
+	       block_size,
+	       audio / total,
+	       times.size() * block_size / total,
+	       times.front(),
+	       percentile(times, 50.0),
+	       percentile(times, 90.0),
+	       percentile(times, 99.0),
+	       times.back(),
+	       budget,
+	       (unsigned long) allocations,
+	       (unsigned long) allocating_blocks,
+	       times.size());
+}
+
+int main(int argc, char **argv)
+{
+	BenchConfig config;
+
+	if (!parse_args(argc, argv, config)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* nothing to cache between runs, and it would be OBS's */
+	LV2World::set_cache_path("");
+	LV2World *world = LV2World::acquire();
+
+	if (world->get_plugin(config.uri) == nullptr) {
+		fprintf(stderr, "plugin %s not found\n", config.uri);
+		LV2World::release();
+		return EXIT_SKIP;
+	}
+
+	LV2Rack *rack = new LV2Rack(config.channels);
+	LV2Plugin *lv2 = rack->get_slot(0);
+
+	lv2->set_uri(config.uri);
+	lv2->set_sample_rate(config.sample_rate);
+	lv2->set_channels(config.channels);
+	rack->set_block_size(config.fixed_block);
+	lv2->update_plugin_instance_async(config.state.c_str());
+	lv2->wait_for_jobs();
+
+	printf("%s, %zu channels at %u Hz%s\n",
+	       config.uri, config.channels, config.sample_rate,
+	       config.fixed_block != 0 ? ", fixed processing blocks" : "");
+
+	for (int block_size: config.block_sizes)
+		run(rack, config, block_size);
+
+	bool ran = lv2->get_dsp_load().blocks > 0;
+
+	delete rack;
+	LV2World::release();
+
+	if (!ran) {
+		fprintf(stderr, "the plugin never ran, failed to instantiate it?\n");
+		return 1;
+	}
+
+	return 0;
+}
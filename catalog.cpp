@@ -0,0 +1,188 @@
+/******************************************************************************
+ *   Copyright (C) 2020 by Arkadiusz Hiler
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+#include "obs-lv2.hpp"
+#include <fstream>
+#include <sys/stat.h>
+#include <dirent.h>
+
+/* Bump whenever the format or meaning of the entries changes, the cache is
+ * then ignored and rebuilt from scratch on the next start.
+ *
+ * The file is line based with tab separated fields:
+ *   obs-lv2-catalog <version>
+ *   bundle <path> <mtime>
+ *   plugin <bundle path> <uri> <audio ins> <audio outs> <has ui> <required features> <name>
+ *   depends <uri> <bundle path>
+ * required features are space separated, name goes last as it's free form,
+ * depends lines always follow the plugin line they refer to */
+#define CATALOG_CACHE_MAGIC "obs-lv2-catalog"
+#define CATALOG_CACHE_VERSION 2
+
+using namespace std;
+
+string LV2World::cache_path;
+
+void LV2World::set_cache_path(const char *path)
+{
+	cache_path = path != nullptr ? path : "";
+}
+
+/* newest mtime of the bundle directory and the files directly in it, editing
+ * a .ttl in place does not touch the directory's own mtime */
+int64_t LV2World::bundle_mtime(const string &path)
+{
+	struct stat st;
+
+	if (stat(path.c_str(), &st) != 0)
+		return -1;
+
+	int64_t mtime = st.st_mtime;
+
+	DIR *dir = opendir(path.c_str());
+	if (dir == nullptr)
+		return mtime;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != nullptr) {
+		string file = path + "/" + entry->d_name;
+
+		if (stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+			mtime = max(mtime, (int64_t) st.st_mtime);
+	}
+
+	closedir(dir);
+
+	return mtime;
+}
+
+static vector<string> split(const string &str, char delim)
+{
+	vector<string> fields;
+	size_t start = 0;
+	size_t end;
+
+	if (str.empty())
+		return fields;
+
+	while ((end = str.find(delim, start)) != string::npos) {
+		fields.push_back(str.substr(start, end - start));
+		start = end + 1;
+	}
+
+	fields.push_back(str.substr(start));
+
+	return fields;
+}
+
+bool LV2World::load_catalog_cache(map<string,int64_t> &bundles,
+				  map<string,LV2PluginInfo> &cached)
+{
+	if (cache_path.empty())
+		return false;
+
+	ifstream file(cache_path);
+	if (!file.is_open())
+		return false;
+
+	string line;
+	getline(file, line);
+
+	auto header = split(line, '\t');
+	if (header.size() != 2 || header[0] != CATALOG_CACHE_MAGIC ||
+	    header[1] != to_string(CATALOG_CACHE_VERSION)) {
+		printf("ignoring LV2 catalog cache %s - unknown version\n",
+		       cache_path.c_str());
+		return false;
+	}
+
+	while (getline(file, line)) {
+		auto fields = split(line, '\t');
+
+		if (fields.size() == 3 && fields[0] == "bundle") {
+			bundles[fields[1]] = strtoll(fields[2].c_str(), NULL, 10);
+		} else if (fields.size() == 8 && fields[0] == "plugin") {
+			LV2PluginInfo info;
+			info.bundle = fields[1];
+			info.uri = fields[2];
+			info.audio_inputs = strtoul(fields[3].c_str(), NULL, 10);
+			info.audio_outputs = strtoul(fields[4].c_str(), NULL, 10);
+			info.has_ui = fields[5] == "1";
+			info.required_features = split(fields[6], ' ');
+			info.name = fields[7];
+
+			cached[info.uri] = info;
+		} else if (fields.size() == 3 && fields[0] == "depends" &&
+			   cached.find(fields[1]) != cached.end()) {
+			cached[fields[1]].dependencies.push_back(fields[2]);
+		} else {
+			printf("ignoring LV2 catalog cache %s - malformed line\n",
+			       cache_path.c_str());
+			bundles.clear();
+			cached.clear();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void LV2World::save_catalog_cache(void)
+{
+	if (cache_path.empty())
+		return;
+
+	string tmp_path = cache_path + ".tmp";
+	ofstream file(tmp_path, ios::trunc);
+
+	if (!file.is_open()) {
+		printf("failed to write LV2 catalog cache %s\n", tmp_path.c_str());
+		return;
+	}
+
+	file << CATALOG_CACHE_MAGIC << '\t' << CATALOG_CACHE_VERSION << '\n';
+
+	for (auto const& b: this->bundle_mtimes)
+		file << "bundle\t" << b.first << '\t' << b.second << '\n';
+
+	for (auto const& entry: this->catalog) {
+		auto const& p = entry.second;
+		string features;
+
+		for (auto const& f: p.required_features) {
+			if (!features.empty())
+				features += ' ';
+			features += f;
+		}
+
+		file << "plugin\t" << p.bundle << '\t' << p.uri << '\t'
+		     << p.audio_inputs << '\t' << p.audio_outputs << '\t'
+		     << (p.has_ui ? "1" : "0") << '\t' << features << '\t'
+		     << p.name << '\n';
+
+		for (auto const& dep: p.dependencies)
+			file << "depends\t" << p.uri << '\t' << dep << '\n';
+	}
+
+	file.close();
+
+	/* rename so a crash mid-write never leaves a truncated cache behind */
+	if (file.fail() || rename(tmp_path.c_str(), cache_path.c_str()) != 0) {
+		printf("failed to write LV2 catalog cache %s\n", cache_path.c_str());
+		remove(tmp_path.c_str());
+	}
+}
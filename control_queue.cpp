@@ -0,0 +1,63 @@
+/******************************************************************************
+ *   Copyright (C) 2020 by Arkadiusz Hiler
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+#include "obs-lv2.hpp"
+
+using namespace std;
+
+ControlQueue::ControlQueue(size_t capacity)
+{
+	size_t size = 1;
+
+	/* power of two, so the positions can just keep counting up */
+	while (size < capacity)
+		size <<= 1;
+
+	this->slots = (ControlChange*) calloc(size, sizeof(*this->slots));
+	this->mask = size - 1;
+}
+
+ControlQueue::~ControlQueue()
+{
+	free(this->slots);
+}
+
+bool ControlQueue::push(uint32_t index, float value)
+{
+	size_t tail = this->tail.load(memory_order_relaxed);
+
+	if (tail - this->head.load(memory_order_acquire) > this->mask)
+		return false;
+
+	this->slots[tail & this->mask] = { index, value };
+	this->tail.store(tail + 1, memory_order_release);
+
+	return true;
+}
+
+bool ControlQueue::pop(ControlChange *change)
+{
+	size_t head = this->head.load(memory_order_relaxed);
+
+	if (head == this->tail.load(memory_order_acquire))
+		return false;
+
+	*change = this->slots[head & this->mask];
+	this->head.store(head + 1, memory_order_release);
+
+	return true;
+}
@@ -21,211 +21,282 @@ using namespace std;
 
 LV2Plugin::LV2Plugin(size_t channels)
 {
-	feature_uri_map_data = { this, LV2Plugin::urid_map };
+	lv2_world = LV2World::acquire();
+	world = lv2_world->get_world();
+
+	feature_uri_map_data = { lv2_world->get_urids(), UridTable::lv2_map };
 	feature_uri_map = { LV2_URID_MAP_URI, &feature_uri_map_data };
 
-	feature_uri_unmap_data = { this, LV2Plugin::urid_unmap };
-	feature_uri_unmap = { LV2_URID_MAP_URI, &feature_uri_unmap_data };
+	feature_uri_unmap_data = { lv2_world->get_urids(), UridTable::lv2_unmap };
+	feature_uri_unmap = { LV2_URID_UNMAP_URI, &feature_uri_unmap_data };
 
 	/* data will be set to plugin instance each time we update */
 	feature_instance_access = { LV2_INSTANCE_ACCESS_URI, nullptr };
 
 	feature_data_access = { LV2_DATA_ACCESS_URI, &feature_data_access_data };
 
+	init_options();
+
 	features[0] = &feature_uri_map;
-	/* XXX: don't expose it, crashes some plugins */
-	/* features[1] = &feature_uri_unmap; */
-	features[1] = &feature_instance_access;
-	features[2] = &feature_data_access;
-	features[3] = nullptr; /* NULL terminated */
+	features[1] = &feature_uri_unmap;
+	features[2] = &feature_instance_access;
+	features[3] = &feature_data_access;
+	features[4] = &feature_options;
+	features[5] = &feature_bounded_block;
+	features[6] = nullptr; /* NULL terminated */
+
+	urid_atom_sequence = urid_map(LV2_ATOM__Sequence);
+	urid_atom_chunk = urid_map(LV2_ATOM__Chunk);
+	urid_atom_event_transfer = urid_map(LV2_ATOM__eventTransfer);
 
 	this->channels = channels;
-	world = lilv_world_new();
-	lilv_world_load_all(world);
-	plugins = lilv_world_get_all_plugins(world);
-	plugin = nullptr;
 	ui_host = suil_host_new(LV2Plugin::suil_write_from_ui,
 				LV2Plugin::suil_port_index,
 				NULL, NULL);
-
-	populate_supported_plugins();
 }
 
 LV2Plugin::~LV2Plugin()
 {
+	wait_for_jobs();
+
 	cleanup_ui();
-	cleanup_plugin_instance();
+	destroy_instance(this->inst);
+
 	suil_host_free(ui_host);
-	lilv_world_free(world);
 	free(plugin_uri);
-	cleanup_ports();
+	LV2World::release();
 }
 
-bool LV2Plugin::is_feature_supported(const LilvNode* node)
+bool LV2Plugin::for_each_supported_plugin(function<void(const char *, const char *)> f)
 {
-	bool is_supported = false;
+	return lv2_world->for_each_supported_plugin(f);
+}
+
+void LV2Plugin::set_uri(const char* uri)
+{
+	lock_guard<mutex> guard(this->control_lock);
+	bool replace = true;
 
-	if (!lilv_node_is_uri(node)) {
-		printf("tested feature passed is not an URI!\n");
-		abort();
+	if (this->plugin_uri != nullptr && uri != nullptr) {
+		if (!strcmp(this->plugin_uri, uri))
+			replace = false;
 	}
 
-	auto node_uri = lilv_node_as_uri(node);
+	if (replace) {
+		if (this->plugin_uri != nullptr)
+			free(this->plugin_uri);
+
+
+		if (uri != nullptr)
+			this->plugin_uri = strdup(uri);
+		else
+			this->plugin_uri = nullptr;
+
+		{
+			lock_guard<mutex> uri_guard(this->uri_copy_lock);
+			this->uri_copy = uri != nullptr ? uri : "";
+		}
 
-	for (auto feature = this->features; *feature != nullptr; feature++) {
-		if (0 == strcmp((*feature)->URI, node_uri))
-			is_supported = true;
+		invalidate_instance();
 	}
+}
 
-	return is_supported;
+/* Qt objects can be touched only from the thread that configures us, so the
+ * UI goes away right here and not in the job replacing the instance */
+void LV2Plugin::invalidate_instance(void)
+{
+	this->instance_needs_update = true;
+	cleanup_ui();
 }
 
-void LV2Plugin::populate_supported_plugins(void)
+void LV2Plugin::update_plugin_instance_async(const char *state)
 {
-	LilvNode* input_port  = lilv_new_uri(world, LV2_CORE__InputPort);
-	LilvNode* output_port = lilv_new_uri(world, LV2_CORE__OutputPort);
-	LilvNode* audio_port  = lilv_new_uri(world, LV2_CORE__AudioPort);
-
-	LILV_FOREACH(plugins, i, this->plugins) {
-		auto plugin = lilv_plugins_get(this->plugins, i);
-		bool skip = false;
-
-		/* filter out plugins which require feature we don't support */
-		auto req_features = lilv_plugin_get_required_features(plugin);
-		LILV_FOREACH(nodes, j, req_features) {
-			const LilvNode* feature = lilv_nodes_get(req_features, j);
-
-			if (!this->is_feature_supported(feature)) {
-				skip = true;
-				printf("%s filtered out because we do not support %s\n",
-				       lilv_node_as_string(lilv_plugin_get_name(plugin)),
-				       lilv_node_as_string(feature));
-				break;
-			}
-		}
-		lilv_nodes_free(req_features);
-
-		if (skip)
-			continue;
-
-		/* filter out plugins without supported UI */
-		skip = true;
-		auto uis = lilv_plugin_get_uis(plugin);
-		auto qt5_uri = lilv_new_uri(this->world, LV2_UI__Qt5UI);
-		LILV_FOREACH(uis, i, uis) {
-			const LilvNode *ui_type;
-			auto ui = lilv_uis_get(uis, i);
-
-			if (lilv_ui_is_supported(ui, suil_ui_supported,
-						 qt5_uri,
-						 &ui_type)) {
-				skip = false;
-			}
-		}
-		lilv_node_free(qt5_uri);
+	lock_guard<mutex> guard(this->control_lock);
 
-		if (skip) {
-			printf("%s filtered out - has no usable GUI\n",
-			       lilv_node_as_string(lilv_plugin_get_name(plugin)));
-			continue;
-		}
+	if (state != nullptr && *state != '\0') {
+		this->pending_state = state;
+		this->has_pending_state = true;
+	}
 
-		auto in_aps = lilv_plugin_get_num_ports_of_class(plugin, audio_port, input_port, NULL);
-		auto out_aps = lilv_plugin_get_num_ports_of_class(plugin, audio_port, output_port, NULL);
+	/* while suspended this only records what we want, it's applied on
+	 * resume */
+	if (!this->suspended)
+		schedule_reconcile();
+}
 
-		if (in_aps < this->get_channels() || out_aps < this->get_channels()) {
-			printf("%s filtered out - supports only %u input and %u output channels, while OBS audio uses %lu\n",
-			       lilv_node_as_string(lilv_plugin_get_name(plugin)),
-			       in_aps, out_aps, this->get_channels());
+void LV2Plugin::suspend(bool free_instance)
+{
+	this->free_when_suspended = free_instance;
 
-			continue;
-		}
+	if (!this->suspended.exchange(true))
+		schedule_reconcile();
+}
 
-		this->supported_pluggins.push_back(pair<string,string>(
-			lilv_node_as_string(lilv_plugin_get_name(plugin)),
-			lilv_node_as_string(lilv_plugin_get_uri(plugin))));
+void LV2Plugin::resume(void)
+{
+	if (this->suspended.exchange(false))
+		schedule_reconcile();
+}
 
-	}
+bool LV2Plugin::is_suspended(void)
+{
+	return this->suspended;
+}
 
-	lilv_node_free(audio_port);
-	lilv_node_free(output_port);
-	lilv_node_free(input_port);
+void LV2Plugin::wait_for_jobs(void)
+{
+	unique_lock<mutex> guard(this->control_lock);
+	this->jobs_done.wait(guard, [this] { return this->pending_jobs == 0; });
 }
 
-void LV2Plugin::for_each_supported_plugin(function<void(const char *, const char *)> f)
+/* The jobs may run in any order on the pool's threads, so they don't carry
+ * any parameters - each one brings the instance to whatever is wanted at the
+ * time it runs. */
+void LV2Plugin::schedule_reconcile(void)
 {
-	for (auto const& p: this->supported_pluggins)
-		f(p.first.c_str(), p.second.c_str());
+	this->pending_jobs++;
+
+	lv2_world->get_tasks()->submit([this] {
+		lock_guard<mutex> guard(this->control_lock);
+
+		reconcile();
+
+		this->pending_jobs--;
+		this->jobs_done.notify_all();
+	});
 }
 
-void LV2Plugin::set_uri(const char* uri)
+void LV2Plugin::reconcile(void)
 {
-	bool replace = true;
+	LV2Instance *inst = this->inst;
 
-	if (this->plugin_uri != nullptr && uri != nullptr) {
-		if (!strcmp(this->plugin_uri, uri))
-			replace = false;
+	if (this->suspended) {
+		bool can_free = this->free_when_suspended && this->ui_instance == nullptr;
+
+		if (inst == nullptr || (!inst->activated && !can_free))
+			return;
+
+		/* fades out to the dry signal */
+		publish(nullptr);
+
+		if (can_free) {
+			/* keep the state around for when we are resumed */
+			keep_state();
+			this->inst.store(nullptr, std::memory_order_release);
+			destroy_instance(inst);
+			this->instance_needs_update = true;
+		} else {
+			deactivate_instance(inst);
+		}
+
+		return;
 	}
 
-	if (replace) {
-		if (this->plugin_uri != nullptr)
-			free(this->plugin_uri);
+	if (this->options_changed)
+		update_options();
+
+	/* the old instance keeps running while the new one is being built and
+	 * warmed up, then we crossfade between them */
+	if (this->instance_needs_update) {
+		/* the UI points into the instance, invalidate_instance() should
+		 * have closed it on the configuring thread, try again after */
+		if (this->ui_instance != nullptr) {
+			WARN("not replacing an instance with its UI open\n");
+			return;
+		}
 
+		this->instance_needs_update = false;
+		this->options_changed = false;
+		this->routing_changed = false;
 
-		if (uri != nullptr)
-			this->plugin_uri = strdup(uri);
-		else
-			this->plugin_uri = nullptr;
+		if (inst != nullptr && this->plugin_uri != nullptr &&
+		    !strcmp(lilv_instance_get_uri(inst->instance), this->plugin_uri))
+			keep_state();
+
+		LV2Instance *prev = inst;
+		inst = create_instance();
+		this->inst.store(inst, std::memory_order_release);
+
+		if (inst != nullptr) {
+			restore_pending_state();
+			activate_instance(inst);
+		}
+
+		publish(this->bypassed ? nullptr : inst);
+		destroy_instance(prev);
 
-		instance_needs_update = true;
+		return;
 	}
-}
 
-void LV2Plugin::cleanup_plugin_instance(void) {
-	if (this->plugin_instance == nullptr)
+	if (inst == nullptr)
 		return;
 
-	lilv_instance_deactivate(this->plugin_instance);
-	lilv_instance_free(this->plugin_instance);
+	/* neither restoring nor setting options can happen while the instance
+	 * is running */
+	bool set_options = this->options_changed && inst->options != nullptr;
+	bool set_routing = this->routing_changed;
+	this->options_changed = false;
+	this->routing_changed = false;
+
+	if (this->has_pending_state || set_options || set_routing) {
+		publish(nullptr);
+		restore_pending_state();
+
+		if (set_options)
+			apply_options(inst);
+
+		if (set_routing)
+			update_routing(inst);
+	}
 
-	this->feature_instance_access.data = nullptr;
-	this->feature_data_access_data.data_access = nullptr;
+	if (!inst->activated)
+		activate_instance(inst);
 
-	this->plugin_instance = nullptr;
+	publish(this->bypassed ? nullptr : inst);
 }
 
-void LV2Plugin::update_plugin_instance(void)
+void LV2Plugin::keep_state(void)
 {
-	if (!this->instance_needs_update)
+	if (this->has_pending_state)
 		return;
 
-	this->ready = false;
-	this->instance_needs_update = false;
+	char *state = serialize_state();
 
-	cleanup_ui();
-	cleanup_plugin_instance();
+	if (state != nullptr) {
+		this->pending_state = state;
+		this->has_pending_state = true;
+		free(state);
+	}
+}
 
-	this->plugin = nullptr;
-	this->ui = nullptr;
+void LV2Plugin::restore_pending_state(void)
+{
+	if (!this->has_pending_state)
+		return;
 
-	cleanup_ports();
+	set_state(this->pending_state.c_str());
+	this->pending_state.clear();
+	this->has_pending_state = false;
+}
 
-	LilvNode *uri = nullptr;
+/* builds an inactive instance with its ports, has to be called with
+ * control_lock held */
+LV2Instance *LV2Plugin::create_instance(void)
+{
+	this->ui = nullptr;
 
-	if (this->plugin_uri != nullptr) {
-		uri = lilv_new_uri(this->world, this->plugin_uri);
-		this->plugin = lilv_plugins_get_by_uri(plugins, uri);
-		lilv_node_free(uri);
-	}
+	auto plugin = lv2_world->get_plugin(this->plugin_uri);
 
-	if (this->plugin == nullptr) {
+	if (plugin == nullptr) {
 		WARN("failed to get plugin by uri\n");
-		return;
+		return nullptr;
 	}
 
+	auto world_guard = lv2_world->lock_world();
+
 	auto qt5_uri = lilv_new_uri(this->world, LV2_UI__Qt5UI);
 
-	auto uis = lilv_plugin_get_uis(this->plugin);
+	auto uis = lilv_plugin_get_uis(plugin);
 	LILV_FOREACH(uis, i, uis) {
 		const LilvNode *ui_type;
 		auto ui = lilv_uis_get(uis, i);
@@ -240,40 +311,247 @@ void LV2Plugin::update_plugin_instance(void)
 	}
 	lilv_node_free(qt5_uri);
 
-	this->plugin_instance = lilv_plugin_instantiate(this->plugin,
-							this->sample_rate,
-							this->features);
+	world_guard.unlock();
+
+	LV2Instance *inst = instantiate(plugin, 0, nullptr);
+
+	if (inst == nullptr)
+		return nullptr;
+
+	this->feature_instance_access.data = lilv_instance_get_handle(inst->instance);
+
+	/* XXX: digging in lilv's internals, there may be a better way to do this */
+	this->feature_data_access_data.data_access = inst->instance->lv2_descriptor->extension_data;
+
+	/* with a routing matrix a single instance does it all */
+	if (!wants_copies(inst)) {
+		update_routing(inst);
+		return inst;
+	}
+
+	/* the rest of the channels go to the copies */
+	size_t per_instance = std::min(inst->input_channels_count,
+				       inst->output_channels_count);
 
-	if (this->plugin_instance == nullptr) {
+	inst->channels = per_instance;
+
+	for (size_t first = per_instance; first < this->channels; first += per_instance) {
+		LV2Instance *copy = instantiate(plugin, first, inst);
+
+		if (copy == nullptr) {
+			destroy_instance(inst);
+			return nullptr;
+		}
+
+		copy->channels = std::min(per_instance, this->channels - first);
+		inst->copies[inst->copies_count++] = copy;
+	}
+
+	return inst;
+}
+
+/* a single instance with its ports for channels starting at first_channel,
+ * create_instance() sorts out how many of them it gets, the copies get their
+ * owner */
+LV2Instance *LV2Plugin::instantiate(const LilvPlugin *plugin, size_t first_channel,
+				    LV2Instance *owner)
+{
+	/* the worker feature points to the instance, so it has to exist
+	 * before the plugin is instantiated */
+	LV2Instance *inst = new LV2Instance();
+	inst->plugin = plugin;
+	inst->owner = owner;
+	inst->channels = this->channels - first_channel;
+	inst->first_channel = first_channel;
+	inst->host = this;
+	inst->workers = lv2_world->get_workers();
+
+	inst->feature_worker_data = { inst, LV2Plugin::worker_schedule };
+	inst->feature_worker = { LV2_WORKER__schedule, &inst->feature_worker_data };
+
+	size_t n = 0;
+	for (auto f = this->features; *f != nullptr; ++f)
+		inst->features[n++] = *f;
+	inst->features[n++] = &inst->feature_worker;
+	inst->features[n] = nullptr;
+
+	auto instance = lv2_world->instantiate(plugin,
+					       this->sample_rate,
+					       inst->features);
+
+	if (instance == nullptr) {
 		WARN("failed to instantiate plugin\n");
+		delete inst;
+		return nullptr;
+	}
+
+	inst->instance = instance;
+	inst->min_block = this->opt_min_block;
+	inst->max_block = this->opt_max_block;
+	inst->sample_rate = this->sample_rate;
+
+	inst->options = (const LV2_Options_Interface*)
+		lilv_instance_get_extension_data(instance, LV2_OPTIONS__interface);
+
+	inst->worker = (const LV2_Worker_Interface*)
+		lilv_instance_get_extension_data(instance, LV2_WORKER__interface);
+
+	if (inst->worker != nullptr) {
+		inst->worker_requests = new ByteRing(WORKER_RING_SIZE);
+		inst->worker_responses = new ByteRing(WORKER_RING_SIZE);
+		inst->worker_response = calloc(WORKER_RING_SIZE, 1);
+		inst->workers->add(inst);
+	}
+
+	this->prepare_ports(inst);
+
+	return inst;
+}
+
+/* the audio thread must be done with it, see publish() */
+void LV2Plugin::destroy_instance(LV2Instance *inst)
+{
+	if (inst == nullptr)
 		return;
+
+	for (size_t i = 0; i < inst->copies_count; ++i)
+		destroy_instance(inst->copies[i]);
+
+	/* a DSP thread may still hold a block the audio thread took back */
+	while (inst->jobs_queued > 0)
+		this_thread::yield();
+
+	/* no work() may be running once we start tearing it down */
+	if (inst->worker != nullptr) {
+		inst->workers->remove(inst);
+		delete inst->worker_requests;
+		delete inst->worker_responses;
+		free(inst->worker_response);
 	}
 
-	this->feature_instance_access.data = lilv_instance_get_handle(this->plugin_instance);
+	deactivate_instance(inst);
 
-	/* XXX: digging in lilv's internals, there may be a better way to do this */
-	this->feature_data_access_data.data_access = this->plugin_instance->lv2_descriptor->extension_data;
+	if (this->feature_instance_access.data == lilv_instance_get_handle(inst->instance)) {
+		this->feature_instance_access.data = nullptr;
+		this->feature_data_access_data.data_access = nullptr;
+	}
+
+	lv2_world->free_instance(inst->instance);
+	cleanup_ports(inst);
+	free_routing(inst->routing);
+
+	delete inst;
+}
+
+/* Runs a few blocks of silence before the audio thread gets the instance, so
+ * the plugin faults in its memory and allocates whatever it does lazily
+ * here and not in the middle of a crossfade. */
+void LV2Plugin::activate_instance(LV2Instance *inst)
+{
+	/* may still point to OBS's buffers from before it was deactivated */
+	connect_audio(inst, nullptr);
+
+	lilv_instance_activate(inst->instance);
+	inst->activated = true;
 
-	this->prepare_ports();
+	int frames = std::min(WARMUP_FRAMES, inst->max_block);
 
-	lilv_instance_activate(this->plugin_instance);
+	for (size_t ch = 0; ch < inst->input_channels_count; ++ch)
+		memset(inst->input_buffer[ch], 0, frames * sizeof(float));
 
-	this->ready = true;
+	for (int i = 0; i < WARMUP_BLOCKS; ++i) {
+		prepare_atom_ports(inst);
+		lilv_instance_run(inst->instance, frames);
+		deliver_worker_responses(inst);
+	}
+
+	for (size_t i = 0; i < inst->copies_count; ++i)
+		activate_instance(inst->copies[i]);
+}
+
+void LV2Plugin::deactivate_instance(LV2Instance *inst)
+{
+	for (size_t i = 0; i < inst->copies_count; ++i)
+		deactivate_instance(inst->copies[i]);
+
+	if (inst->activated)
+		lilv_instance_deactivate(inst->instance);
+
+	inst->activated = false;
+}
+
+/* Hands the instance over to the audio thread (nullptr passes the audio
+ * through) and waits until it's done with the previous one, crossfade
+ * included, so that one can be deactivated or freed.
+ *
+ * The audio thread picks up the published pointer at the start of each block
+ * and reports back what it used once the block is done. If it's not running
+ * us at all there's nothing to fade - we just take dsp_lock and do the switch
+ * ourselves. */
+void LV2Plugin::publish(LV2Instance *next)
+{
+	LV2Instance *prev = this->published.exchange(next, memory_order_acq_rel);
+
+	wait_for_handover(next);
+
+	/* the copies of the one it was running may still be on the DSP
+	 * threads, it fades without them */
+	if (prev != next)
+		wait_for_copy_jobs(prev);
+}
+
+void LV2Plugin::wait_for_handover(LV2Instance *next)
+{
+	uint64_t blocks = this->dsp_blocks;
+	auto progress = chrono::steady_clock::now();
+
+	for (;;) {
+		/* running is reported after fading, see process_frames() */
+		if (this->dsp_running_seen.load(memory_order_acquire) == next &&
+		    this->dsp_fading_seen.load(memory_order_acquire) == nullptr)
+			return;
+
+		this_thread::sleep_for(chrono::milliseconds(1));
+
+		auto now = chrono::steady_clock::now();
+
+		if (this->dsp_blocks != blocks) {
+			blocks = this->dsp_blocks;
+			progress = now;
+		} else if (now - progress > chrono::milliseconds(DSP_IDLE_MS)) {
+			lock_guard<mutex> dsp_guard(this->dsp_lock);
+
+			this->dsp_running = next;
+			this->dsp_fading = nullptr;
+			this->fade_pos = 0;
+			this->fading = false;
+
+			this->dsp_fading_seen.store(nullptr, memory_order_release);
+			this->dsp_running_seen.store(next, memory_order_release);
+
+			return;
+		}
+	}
 }
 
 void LV2Plugin::set_sample_rate(uint32_t sample_rate)
 {
+	lock_guard<mutex> guard(this->control_lock);
+
 	if (this->sample_rate != sample_rate) {
 		this->sample_rate = sample_rate;
-		this->instance_needs_update = true;
+		this->options_changed = true;
+		invalidate_instance();
 	}
 }
 
 void LV2Plugin::set_channels(size_t channels)
 {
+	lock_guard<mutex> guard(this->control_lock);
+
 	if (this->channels != channels) {
 		this->channels = channels;
-		this->instance_needs_update = true;
+		invalidate_instance();
 	}
 }
 
@@ -282,15 +560,52 @@ size_t LV2Plugin::get_channels(void)
 	return this->channels;
 }
 
+void LV2Plugin::set_block_size(size_t frames)
+{
+	lock_guard<mutex> guard(this->control_lock);
+
+	if (this->block_size != frames) {
+		this->block_size = frames;
+		this->options_changed = true;
+
+		/* it may have sized its buffers for shorter blocks, or count on
+		 * blocks of at least some length, and without opts:interface
+		 * there is no way to tell it, so it has to be built again */
+		int min_block = frames;
+		int max_block = frames != 0 ? frames : MAX_AUDIO_FRAMES;
+		LV2Instance *inst = this->inst;
+
+		if (inst != nullptr && inst->options == nullptr &&
+		    (max_block > inst->max_block || min_block < inst->min_block))
+			invalidate_instance();
+	}
+}
+
+void LV2Plugin::set_bypass(bool bypass)
+{
+	if (this->bypassed.exchange(bypass) != bypass)
+		schedule_reconcile();
+}
+
+DspLoad::Stats LV2Plugin::get_dsp_load(void)
+{
+	return this->dsp_load.get();
+}
+
+/* empty if there's no plugin */
+string LV2Plugin::get_uri(void)
+{
+	lock_guard<mutex> guard(this->uri_copy_lock);
+
+	return this->uri_copy;
+}
+
+/* from the UI's thread too */
 uint32_t LV2Plugin::port_index(const char *symbol) {
-	LilvNode* lilv_sym   = lilv_new_string(this->world, symbol);
-	const LilvPort* port = lilv_plugin_get_port_by_symbol(this->plugin, lilv_sym);
-	lilv_node_free(lilv_sym);
+	LV2Instance *inst = this->inst.load(std::memory_order_acquire);
 
-	if (port == nullptr)
+	if (inst == nullptr)
 		return LV2UI_INVALID_PORT_INDEX;
 
-	auto idx = lilv_port_get_index(this->plugin, port);
-
-	return idx;
+	return inst->port_table->find(symbol);
 }
@@ -0,0 +1,88 @@
+/******************************************************************************
+ *   Copyright (C) 2020 by Arkadiusz Hiler
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+#include "obs-lv2.hpp"
+
+/* There's a single writer, so plain loads and stores are enough for it and
+ * the readers may see a block half accounted for, which is fine for
+ * statistics. */
+void DspLoad::add(uint64_t ns, uint64_t budget_ns)
+{
+	auto relaxed = std::memory_order_relaxed;
+
+	if (budget_ns == 0)
+		return;
+
+	this->blocks.store(this->blocks.load(relaxed) + 1, relaxed);
+	this->sum_ns.store(this->sum_ns.load(relaxed) + ns, relaxed);
+	this->sum_budget_ns.store(this->sum_budget_ns.load(relaxed) + budget_ns, relaxed);
+
+	if (ns < this->min_ns.load(relaxed))
+		this->min_ns.store(ns, relaxed);
+
+	if (ns > this->max_ns.load(relaxed))
+		this->max_ns.store(ns, relaxed);
+
+	if (ns > budget_ns)
+		this->over_budget.store(this->over_budget.load(relaxed) + 1, relaxed);
+
+	/* a percent of the budget each, the last one is everything above */
+	size_t bucket = std::min((uint64_t) DSP_LOAD_BUCKETS - 1, ns * 100 / budget_ns);
+	this->buckets[bucket].store(this->buckets[bucket].load(relaxed) + 1, relaxed);
+}
+
+DspLoad::Stats DspLoad::get(void)
+{
+	auto relaxed = std::memory_order_relaxed;
+	Stats stats;
+
+	stats.blocks = this->blocks.load(relaxed);
+	stats.over_budget = this->over_budget.load(relaxed);
+
+	if (stats.blocks == 0)
+		return stats;
+
+	uint64_t min_ns = this->min_ns.load(relaxed);
+	uint64_t sum_ns = this->sum_ns.load(relaxed);
+	uint64_t sum_budget_ns = this->sum_budget_ns.load(relaxed);
+
+	stats.min_us = min_ns / 1000.0;
+	stats.max_us = this->max_ns.load(relaxed) / 1000.0;
+	stats.mean_us = sum_ns / 1000.0 / stats.blocks;
+	stats.mean_load = sum_budget_ns != 0 ? 100.0 * sum_ns / sum_budget_ns : 0.0;
+
+	uint64_t counts[DSP_LOAD_BUCKETS];
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < DSP_LOAD_BUCKETS; ++i) {
+		counts[i] = this->buckets[i].load(relaxed);
+		total += counts[i];
+	}
+
+	uint64_t below = 0;
+
+	for (size_t i = 0; i < DSP_LOAD_BUCKETS; ++i) {
+		below += counts[i];
+
+		if (below * 100 >= total * 99) {
+			stats.p99_load = i + 1;
+			break;
+		}
+	}
+
+	return stats;
+}
@@ -0,0 +1,136 @@
+/******************************************************************************
+ *   Copyright (C) 2020 by Arkadiusz Hiler
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+#include "obs-lv2.hpp"
+
+using namespace std;
+
+/* A bounded queue for many producers and many consumers, each cell carries
+ * a sequence number telling whose turn it is, so nobody ever takes a lock.
+ * See Dmitry Vyukov's bounded MPMC queue. */
+DspPool::DspPool(size_t threads)
+{
+	size_t size = 1;
+
+	while (size < DSP_QUEUE_SIZE)
+		size <<= 1;
+
+	this->cells = new Cell[size];
+	this->mask = size - 1;
+
+	for (size_t i = 0; i < size; ++i)
+		this->cells[i].seq.store(i, memory_order_relaxed);
+
+	sem_init(&this->wakeup, 0, 0);
+
+	if (threads == 0)
+		threads = 1;
+
+	for (size_t i = 0; i < threads; ++i)
+		this->workers.push_back(thread(&DspPool::work, this));
+}
+
+DspPool::~DspPool()
+{
+	this->stopping = true;
+
+	for (size_t i = 0; i < this->workers.size(); ++i)
+		sem_post(&this->wakeup);
+
+	for (auto &worker: this->workers)
+		worker.join();
+
+	sem_destroy(&this->wakeup);
+	delete[] this->cells;
+}
+
+/* fine for the audio thread, fails if the queue is full */
+bool DspPool::submit(void (*run)(void *), void *arg)
+{
+	size_t pos = this->enqueue_pos.load(memory_order_relaxed);
+	Cell *cell;
+
+	for (;;) {
+		cell = &this->cells[pos & this->mask];
+		size_t seq = cell->seq.load(memory_order_acquire);
+		intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+		if (diff == 0) {
+			if (this->enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = this->enqueue_pos.load(memory_order_relaxed);
+		}
+	}
+
+	cell->run = run;
+	cell->arg = arg;
+	cell->seq.store(pos + 1, memory_order_release);
+
+	sem_post(&this->wakeup);
+
+	return true;
+}
+
+bool DspPool::take(void (**run)(void *), void **arg)
+{
+	size_t pos = this->dequeue_pos.load(memory_order_relaxed);
+	Cell *cell;
+
+	for (;;) {
+		cell = &this->cells[pos & this->mask];
+		size_t seq = cell->seq.load(memory_order_acquire);
+		intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+		if (diff == 0) {
+			if (this->dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = this->dequeue_pos.load(memory_order_relaxed);
+		}
+	}
+
+	*run = cell->run;
+	*arg = cell->arg;
+	cell->seq.store(pos + this->mask + 1, memory_order_release);
+
+	return true;
+}
+
+void DspPool::work(void)
+{
+	for (;;) {
+		sem_wait(&this->wakeup);
+
+		if (this->stopping)
+			return;
+
+		void (*run)(void *);
+		void *arg;
+
+		/* each post has its job, but an earlier cell may still be
+		 * being filled by another producer */
+		while (!take(&run, &arg))
+			this_thread::yield();
+
+		run(arg);
+	}
+}
@@ -16,18 +16,122 @@
 *****************************************************************************/
 
 #include <obs/obs-module.h>
+#include <obs/util/platform.h>
 #include "obs-lv2.hpp"
 
 #define PROP_PLUGIN_LIST "lv2_plugin_list"
 #define PROP_TOGGLE_BUTTON "lv2_toggle_gui_button"
+#define PROP_IDLE_POLICY "lv2_idle_policy"
+#define PROP_IDLE_TIMEOUT "lv2_idle_timeout"
+#define PROP_BLOCK_SIZE "lv2_block_size"
+#define PROP_RACK_SLOTS "lv2_rack_slots"
+#define PROP_PIPELINED "lv2_pipelined"
+#define PROP_OFFLOADED "lv2_offloaded"
+#define PROP_BYPASS "lv2_bypass"
+#define PROP_ROUTING "lv2_routing"
+#define PROP_ROUTING_INPUT "lv2_routing_input"
+#define PROP_ROUTING_OUTPUT "lv2_routing_output"
+#define PROP_STATE "lv2_plugin_state"
+#define PROP_UI_UPDATE_RATE "lv2_ui_update_rate"
+#define PROP_DSP_LOAD "lv2_dsp_load"
+
+/* what happens to the plug-in when the source it's on is not in use */
+enum IdlePolicy
+{
+	IDLE_KEEP,
+	IDLE_DEACTIVATE,
+	IDLE_FREE,
+};
 
 class PluginData
 {
 	public:
-	GuiUpdateTimer *timer;
-	LV2Plugin *lv2;
+	obs_source_t *source;
+	LV2Rack *rack;
+
+	std::atomic<int> idle_policy { IDLE_KEEP };
+	std::atomic<float> idle_timeout { 0.0f };
+	std::atomic<float> idle_time { 0.0f };
 };
 
+/* all live filters, so their properties can be refreshed once the plugin
+ * catalog is ready */
+static std::mutex filters_lock;
+static std::set<PluginData*> filters;
+
+static void refresh_filter_properties(void)
+{
+	std::lock_guard<std::mutex> guard(filters_lock);
+
+	for (auto d: filters)
+		obs_source_update_properties(d->source);
+}
+
+static std::string format_dsp_load(const DspLoad::Stats &stats)
+{
+	if (stats.blocks == 0)
+		return "not running";
+
+	char text[256];
+	snprintf(text, sizeof(text),
+		 "%.1f%% of the budget on average, %.0f%% at p99, "
+		 "%.0f/%.0f/%.0f us min/mean/max per block, "
+		 "%llu of %llu blocks over budget",
+		 stats.mean_load, stats.p99_load,
+		 stats.min_us, stats.mean_us, stats.max_us,
+		 (unsigned long long) stats.over_budget,
+		 (unsigned long long) stats.blocks);
+
+	return text;
+}
+
+/* so the expensive plug-ins can be spotted in the logs */
+static std::mutex load_log_lock;
+static std::condition_variable load_log_cond;
+static std::thread load_log_thread;
+static bool load_log_stopping = false;
+
+static void log_dsp_load(void)
+{
+	std::unique_lock<std::mutex> stop_guard(load_log_lock);
+
+	while (!load_log_cond.wait_for(stop_guard,
+				       std::chrono::seconds(DSP_LOAD_LOG_SECONDS),
+				       [] { return load_log_stopping; })) {
+		std::vector<std::string> lines;
+
+		/* creating and destroying filters waits for this, so only
+		 * what's quick to get is gathered here */
+		{
+			std::lock_guard<std::mutex> guard(filters_lock);
+
+			for (auto d: filters) {
+				for (size_t i = 0; i < d->rack->get_slots_count(); ++i) {
+					LV2Plugin *lv2 = d->rack->find_slot(i);
+
+					if (lv2 == nullptr)
+						continue;
+
+					auto stats = lv2->get_dsp_load();
+
+					if (stats.blocks == 0)
+						continue;
+
+					char line[512];
+					snprintf(line, sizeof(line), "%s, plug-in %zu (%s): %s",
+						 obs_source_get_name(d->source), i + 1,
+						 lv2->get_uri().c_str(),
+						 format_dsp_load(stats).c_str());
+					lines.push_back(line);
+				}
+			}
+		}
+
+		for (auto &line: lines)
+			blog(LOG_INFO, "[obs-lv2] %s", line.c_str());
+	}
+}
+
 OBS_DECLARE_MODULE()
 MODULE_EXPORT const char *obs_module_description(void)
 {
@@ -40,7 +144,27 @@ static const char *obs_filter_name(void *unused)
 	return "LV2";
 }
 
-static void obs_filter_update(void *data, obs_data_t *settings);
+static void apply_settings(PluginData *data, obs_data_t *settings);
+
+/* the first slot uses the keys from before there was a rack, so the existing
+ * filters keep working, the others get a suffix */
+static std::string slot_key(const char *base, size_t idx)
+{
+	if (idx == 0)
+		return base;
+
+	return std::string(base) + "_" + std::to_string(idx + 1);
+}
+
+static size_t slot_from_key(const char *key, const char *base)
+{
+	const char *suffix = key + strlen(base);
+
+	if (*suffix != '_')
+		return 0;
+
+	return strtoul(suffix + 1, nullptr, 10) - 1;
+}
 
 static void *obs_filter_create(obs_data_t *settings, obs_source_t *filter)
 {
@@ -49,14 +173,25 @@ static void *obs_filter_create(obs_data_t *settings, obs_source_t *filter)
 
 	PluginData *data = new PluginData();
 
-	data->lv2 = new LV2Plugin(channels);
-	const char *state = obs_data_get_string(settings, "lv2_plugin_state");
+	data->source = filter;
+	data->rack = new LV2Rack(channels);
 
-	obs_filter_update(data, settings);
-	data->lv2->set_state(state);
+	apply_settings(data, settings);
 
-	data->timer = new GuiUpdateTimer(data->lv2);
-	data->timer->start();
+	/* nothing gets instantiated until the source is first used */
+	if (data->idle_policy != IDLE_KEEP)
+		data->rack->suspend(data->idle_policy == IDLE_FREE);
+
+	/* instantiating and restoring the state happens in the background,
+	 * so loading a scene collection doesn't wait for each filter */
+	for (size_t i = 0; i < data->rack->get_slots_count(); ++i) {
+		auto key = slot_key(PROP_STATE, i);
+		const char *state = obs_data_get_string(settings, key.c_str());
+		data->rack->get_slot(i)->update_plugin_instance_async(state);
+	}
+
+	std::lock_guard<std::mutex> guard(filters_lock);
+	filters.insert(data);
 
 	return data;
 }
@@ -65,13 +200,32 @@ static void obs_filter_destroy(void *data)
 {
 	PluginData *d = (PluginData*) data;
 
-	d->timer->deleteLater();
-	delete d->lv2;
+	{
+		std::lock_guard<std::mutex> guard(filters_lock);
+		filters.erase(d);
+	}
+
+	delete d->rack;
 }
 
 static bool obs_toggle_gui(obs_properties_t *props, obs_property_t *property, void *data)
 {
-	LV2Plugin *lv2 = ((PluginData*) data)->lv2;
+	LV2Rack *rack = ((PluginData*) data)->rack;
+	LV2Plugin *lv2 = rack->get_slot(slot_from_key(obs_property_name(property),
+							 PROP_TOGGLE_BUTTON));
+
+	if (lv2 == nullptr)
+		return false;
+
+	/* the UI needs an instance, even if the source is not in use */
+	if (rack->is_suspended()) {
+		((PluginData*) data)->idle_time = 0.0f;
+		rack->resume();
+	}
+
+	/* and it has to be the one that's going to stay */
+	lv2->wait_for_jobs();
+
 	lv2->prepare_ui();
 
 	if (lv2->is_ui_visible())
@@ -82,71 +236,329 @@ static bool obs_toggle_gui(obs_properties_t *props, obs_property_t *property, vo
 	return true;
 }
 
+static bool obs_slots_changed(obs_properties_t *props,
+			      obs_property_t *property,
+			      obs_data_t *settings)
+{
+	size_t count = (size_t) obs_data_get_int(settings, PROP_RACK_SLOTS);
+
+	for (size_t i = 0; i < MAX_RACK_SLOTS; ++i) {
+		const char *keys[] = { PROP_PLUGIN_LIST, PROP_TOGGLE_BUTTON,
+				       PROP_BYPASS, PROP_ROUTING, PROP_DSP_LOAD };
+
+		for (auto key: keys) {
+			auto p = obs_properties_get(props, slot_key(key, i).c_str());
+			obs_property_set_visible(p, i < count);
+		}
+
+		/* the matrix only for the custom routing */
+		bool custom = obs_data_get_int(settings, slot_key(PROP_ROUTING, i).c_str()) == ROUTING_CUSTOM;
+		const char *matrix_keys[] = { PROP_ROUTING_INPUT, PROP_ROUTING_OUTPUT };
+
+		for (auto key: matrix_keys) {
+			auto p = obs_properties_get(props, slot_key(key, i).c_str());
+			obs_property_set_visible(p, i < count && custom);
+		}
+	}
+
+	return true;
+}
+
 static obs_properties_t *obs_filter_properties(void *data)
 {
-	LV2Plugin *lv2 = ((PluginData*) data)->lv2;
+	LV2Rack *rack = ((PluginData*) data)->rack;
 
 	obs_properties_t *props = obs_properties_create();
 
-	obs_property_t *list  = obs_properties_add_list(props,
-							PROP_PLUGIN_LIST,
-							"Plugin",
-							OBS_COMBO_TYPE_LIST,
-							OBS_COMBO_FORMAT_STRING);
-
-	obs_properties_add_button(props,
-				  PROP_TOGGLE_BUTTON,
-				  "Toggle LV2 Plugin's GUI",
-				  obs_toggle_gui);
+	obs_property_t *slots = obs_properties_add_int(props,
+						       PROP_RACK_SLOTS,
+						       "Plug-ins in the chain",
+						       1, MAX_RACK_SLOTS, 1);
+	obs_property_set_modified_callback(slots, obs_slots_changed);
 
-	obs_property_list_add_string(list, "{select a plug-in}", "");
+	std::vector<std::pair<std::string,std::string>> plugins;
 
-	lv2->for_each_supported_plugin([&](const char *name, const char *uri) {
-		obs_property_list_add_string(list, name, uri);
+	bool ready = rack->get_slot(0)->for_each_supported_plugin([&](const char *name, const char *uri) {
+		plugins.push_back({ name, uri });
 	});
 
+	for (size_t i = 0; i < MAX_RACK_SLOTS; ++i) {
+		std::string title = "Plugin";
+
+		if (i != 0)
+			title += " " + std::to_string(i + 1);
+
+		obs_property_t *list  = obs_properties_add_list(props,
+								slot_key(PROP_PLUGIN_LIST, i).c_str(),
+								title.c_str(),
+								OBS_COMBO_TYPE_LIST,
+								OBS_COMBO_FORMAT_STRING);
+
+		obs_properties_add_button(props,
+					  slot_key(PROP_TOGGLE_BUTTON, i).c_str(),
+					  "Toggle LV2 Plugin's GUI",
+					  obs_toggle_gui);
+
+		obs_properties_add_bool(props,
+					slot_key(PROP_BYPASS, i).c_str(),
+					"Bypass");
+
+		LV2Plugin *lv2 = rack->find_slot(i);
+		std::string load = "DSP load: ";
+		load += format_dsp_load(lv2 != nullptr ? lv2->get_dsp_load() : DspLoad::Stats());
+
+		obs_properties_add_text(props,
+					slot_key(PROP_DSP_LOAD, i).c_str(),
+					load.c_str(),
+					OBS_TEXT_INFO);
+
+		obs_property_t *routing = obs_properties_add_list(props,
+								  slot_key(PROP_ROUTING, i).c_str(),
+								  "Channel routing",
+								  OBS_COMBO_TYPE_LIST,
+								  OBS_COMBO_FORMAT_INT);
+
+		obs_property_list_add_int(routing, "By index (a plug-in per channel if it has too few)", ROUTING_BY_INDEX);
+		obs_property_list_add_int(routing, "Downmix the channels into the plug-in's ports", ROUTING_DOWNMIX);
+		obs_property_list_add_int(routing, "Upmix the channels over the plug-in's ports", ROUTING_UPMIX);
+		obs_property_list_add_int(routing, "Custom", ROUTING_CUSTOM);
+		obs_property_set_modified_callback(routing, obs_slots_changed);
+
+		obs_property_t *input = obs_properties_add_text(props,
+								slot_key(PROP_ROUTING_INPUT, i).c_str(),
+								"Input matrix",
+								OBS_TEXT_MULTILINE);
+		obs_property_set_long_description(input,
+						  "A line per plug-in's input port with the gain of each "
+						  "of the source's channels, e.g. \"0.5 0.5\" takes both "
+						  "channels of a stereo source at half volume.");
+
+		obs_property_t *output = obs_properties_add_text(props,
+								 slot_key(PROP_ROUTING_OUTPUT, i).c_str(),
+								 "Output matrix",
+								 OBS_TEXT_MULTILINE);
+		obs_property_set_long_description(output,
+						  "A line per source's channel with the gain of each of "
+						  "the plug-in's output ports, channels with no gains keep "
+						  "their dry signal.");
+
+		obs_property_list_add_string(list, "{select a plug-in}", "");
+
+		for (auto &plugin: plugins)
+			obs_property_list_add_string(list, plugin.first.c_str(), plugin.second.c_str());
+
+		/* the list gets refreshed once the scan is done */
+		if (!ready) {
+			auto idx = obs_property_list_add_string(list, "{scanning for plug-ins...}", "");
+			obs_property_list_item_disable(list, idx, true);
+		}
+	}
+
+	obs_property_t *policy = obs_properties_add_list(props,
+							 PROP_IDLE_POLICY,
+							 "When the source is not in use",
+							 OBS_COMBO_TYPE_LIST,
+							 OBS_COMBO_FORMAT_INT);
+
+	obs_property_list_add_int(policy, "Keep the plug-in running", IDLE_KEEP);
+	obs_property_list_add_int(policy, "Deactivate the plug-in", IDLE_DEACTIVATE);
+	obs_property_list_add_int(policy, "Unload the plug-in", IDLE_FREE);
+
+	obs_properties_add_int(props,
+			       PROP_IDLE_TIMEOUT,
+			       "Seconds before the source counts as not in use",
+			       0, 3600, 1);
+
+	obs_properties_add_int(props,
+			       PROP_UI_UPDATE_RATE,
+			       "Plug-in GUI refresh rate (Hz)",
+			       1, 120, 1);
+
+	obs_property_t *block = obs_properties_add_list(props,
+							PROP_BLOCK_SIZE,
+							"Processing block size",
+							OBS_COMBO_TYPE_LIST,
+							OBS_COMBO_FORMAT_INT);
+
+	obs_property_list_add_int(block, "As it comes from OBS (no added latency)", 0);
+
+	/* e.g. FFT based plug-ins work best with fixed power of two blocks */
+	uint32_t sample_rate = audio_output_get_sample_rate(obs_get_audio());
+	for (int frames = 256; frames <= MAX_AUDIO_FRAMES; frames *= 2) {
+		char name[64];
+		snprintf(name, sizeof(name), "%d frames (adds %.1f ms of latency)",
+			 frames, frames * 1000.0 / sample_rate);
+		obs_property_list_add_int(block, name, frames);
+	}
+
+	obs_property_t *pipelined = obs_properties_add_bool(props,
+							    PROP_PIPELINED,
+							    "Spread the chain over CPU cores (adds a block of latency per plug-in)");
+
+	char latency[128];
+	snprintf(latency, sizeof(latency),
+		 "Each plug-in runs on its own thread, a block behind the one before it. "
+		 "The filter currently adds %.1f ms of latency.",
+		 rack->get_latency() * 1000.0 / sample_rate);
+	obs_property_set_long_description(pipelined, latency);
+
+	obs_property_t *offloaded = obs_properties_add_bool(props,
+							    PROP_OFFLOADED,
+							    "Process on the shared DSP threads (adds a block of latency)");
+
+	snprintf(latency, sizeof(latency),
+		 "The chain runs on threads shared by all the LV2 filters, so many "
+		 "filters can use many cores. Spreading over the cores above takes "
+		 "precedence. The filter currently adds %.1f ms of latency.",
+		 rack->get_latency() * 1000.0 / sample_rate);
+	obs_property_set_long_description(offloaded, latency);
+
 	return props;
 }
 
-static void obs_filter_update(void *data, obs_data_t *settings)
+static void obs_filter_defaults(obs_data_t *settings)
 {
-	auto obs_audio = obs_get_audio();
-	LV2Plugin *lv2 = ((PluginData*) data)->lv2;
+	obs_data_set_default_int(settings, PROP_IDLE_POLICY, IDLE_DEACTIVATE);
+	obs_data_set_default_int(settings, PROP_IDLE_TIMEOUT, 60);
+	obs_data_set_default_int(settings, PROP_UI_UPDATE_RATE, (int) UI_UPDATE_RATE);
+	obs_data_set_default_int(settings, PROP_BLOCK_SIZE, 0);
+	obs_data_set_default_int(settings, PROP_RACK_SLOTS, 1);
+}
 
-	const char *uri = obs_data_get_string(settings, PROP_PLUGIN_LIST);
+static void apply_settings(PluginData *data, obs_data_t *settings)
+{
+	auto obs_audio = obs_get_audio();
+	LV2Rack *rack = data->rack;
 
 	uint32_t sample_rate = audio_output_get_sample_rate(obs_audio);
 	size_t channels = audio_output_get_channels(obs_audio);
 
+	rack->set_slots_count((size_t) obs_data_get_int(settings, PROP_RACK_SLOTS));
 
-	if (strlen(uri) == 0)
-		lv2->set_uri(nullptr);
-	else
-		lv2->set_uri(uri);
+	for (size_t i = 0; i < MAX_RACK_SLOTS; ++i) {
+		LV2Plugin *lv2 = rack->find_slot(i);
+
+		if (lv2 == nullptr)
+			continue;
+
+		/* unused slots just drop their plugin */
+		if (i >= rack->get_slots_count()) {
+			lv2->set_uri(nullptr);
+			continue;
+		}
+
+		const char *uri = obs_data_get_string(settings, slot_key(PROP_PLUGIN_LIST, i).c_str());
+
+		if (strlen(uri) == 0)
+			lv2->set_uri(nullptr);
+		else
+			lv2->set_uri(uri);
+
+		lv2->set_sample_rate(sample_rate);
+		lv2->set_channels(channels);
+		lv2->set_bypass(obs_data_get_bool(settings, slot_key(PROP_BYPASS, i).c_str()));
+		lv2->set_routing((RoutingPreset) obs_data_get_int(settings, slot_key(PROP_ROUTING, i).c_str()),
+				 obs_data_get_string(settings, slot_key(PROP_ROUTING_INPUT, i).c_str()),
+				 obs_data_get_string(settings, slot_key(PROP_ROUTING_OUTPUT, i).c_str()));
+	}
+
+	data->idle_policy = (int) obs_data_get_int(settings, PROP_IDLE_POLICY);
+	data->idle_timeout = (float) obs_data_get_int(settings, PROP_IDLE_TIMEOUT);
+
+	rack->set_ui_update_rate((float) obs_data_get_int(settings, PROP_UI_UPDATE_RATE));
+
+	rack->set_block_size((size_t) obs_data_get_int(settings, PROP_BLOCK_SIZE));
+	rack->set_pipelined(obs_data_get_bool(settings, PROP_PIPELINED));
+	rack->set_offloaded(obs_data_get_bool(settings, PROP_OFFLOADED));
+}
+
+static void obs_filter_update(void *data, obs_data_t *settings)
+{
+	PluginData *d = (PluginData*) data;
+
+	apply_settings(d, settings);
+
+	if (d->idle_policy == IDLE_KEEP)
+		d->rack->resume();
+
+	for (size_t i = 0; i < MAX_RACK_SLOTS; ++i) {
+		if (d->rack->find_slot(i) != nullptr)
+			d->rack->find_slot(i)->update_plugin_instance_async();
+	}
+}
+
+static void obs_filter_activate(void *data)
+{
+	PluginData *d = (PluginData*) data;
+
+	d->idle_time = 0.0f;
+	d->rack->resume();
+}
 
-	lv2->set_sample_rate(sample_rate);
-	lv2->set_channels(channels);
+static void obs_filter_deactivate(void *data)
+{
+	PluginData *d = (PluginData*) data;
+
+	/* start counting, obs_filter_tick() suspends us once it runs out */
+	d->idle_time = 0.0f;
+}
+
+/* activate/show are not guaranteed to reach filters on every path (e.g. when
+ * a filter is added to a source that's already active), so the parent is
+ * polled here and the callbacks are only a shortcut */
+static void obs_filter_tick(void *data, float seconds)
+{
+	PluginData *d = (PluginData*) data;
+	obs_source_t *parent = obs_filter_get_parent(d->source);
+
+	if (parent != nullptr &&
+	    (obs_source_active(parent) || obs_source_showing(parent))) {
+		d->idle_time = 0.0f;
+
+		/* every frame, so the rack's lock only when there's something
+		 * to do */
+		if (d->rack->is_suspended())
+			d->rack->resume();
+
+		return;
+	}
+
+	if (d->idle_policy == IDLE_KEEP || d->rack->is_suspended())
+		return;
+
+	d->idle_time = d->idle_time + seconds;
 
-	lv2->update_plugin_instance();
+	if (d->idle_time >= d->idle_timeout)
+		d->rack->suspend(d->idle_policy == IDLE_FREE);
 }
 
 static struct obs_audio_data *
 obs_filter_audio(void *data, struct obs_audio_data *audio)
 {
-	LV2Plugin *lv2 = ((PluginData*) data)->lv2;
+	LV2Rack *rack = ((PluginData*) data)->rack;
 	float **audio_data = (float **)audio->data;
 
-	lv2->process_frames(audio_data, audio->frames);
+	rack->process_frames(audio_data, audio->frames);
 
 	return audio;
 }
 
 static void obs_filter_save(void *data, obs_data_t *settings)
 {
-	LV2Plugin *lv2 = ((PluginData*) data)->lv2;
-	auto state = lv2->get_state();
-	obs_data_set_string(settings, "lv2_plugin_state", state);
-	free(state);
+	LV2Rack *rack = ((PluginData*) data)->rack;
+
+	for (size_t i = 0; i < MAX_RACK_SLOTS; ++i) {
+		auto key = slot_key(PROP_STATE, i);
+
+		if (i >= rack->get_slots_count()) {
+			obs_data_erase(settings, key.c_str());
+			continue;
+		}
+
+		auto state = rack->get_slot(i)->get_state();
+		obs_data_set_string(settings, key.c_str(), state);
+		free(state);
+	}
 }
 
 struct obs_source_info obs_lv2_filter = {
@@ -158,14 +570,14 @@ struct obs_source_info obs_lv2_filter = {
 	.destroy             = obs_filter_destroy,
 	.get_width           = nullptr,
 	.get_height          = nullptr,
-	.get_defaults        = nullptr,
+	.get_defaults        = obs_filter_defaults,
 	.get_properties      = obs_filter_properties,
 	.update              = obs_filter_update,
-	.activate            = nullptr,
-	.deactivate          = nullptr,
-	.show                = nullptr,
-	.hide                = nullptr,
-	.video_tick          = nullptr,
+	.activate            = obs_filter_activate,
+	.deactivate          = obs_filter_deactivate,
+	.show                = obs_filter_activate,
+	.hide                = obs_filter_deactivate,
+	.video_tick          = obs_filter_tick,
 	.video_render        = nullptr,
 	.filter_video        = nullptr,
 	.filter_audio        = obs_filter_audio,
@@ -175,6 +587,36 @@ struct obs_source_info obs_lv2_filter = {
 
 bool obs_module_load(void)
 {
+	char *cache_path = obs_module_config_path("catalog.cache");
+	char *config_dir = obs_module_config_path("");
+	os_mkdirs(config_dir);
+	LV2World::set_cache_path(cache_path);
+	bfree(config_dir);
+	bfree(cache_path);
+
+	auto world = LV2World::acquire();
+	world->set_catalog_ready_callback(refresh_filter_properties);
+	world->start_scan();
+
+	/* it's a QObject, has to be made on the main thread */
+	GuiUpdateTimer::get();
+
+	load_log_thread = std::thread(log_dsp_load);
+
 	obs_register_source(&obs_lv2_filter);
 	return true;
 }
+
+void obs_module_unload(void)
+{
+	{
+		std::lock_guard<std::mutex> guard(load_log_lock);
+		load_log_stopping = true;
+	}
+
+	load_log_cond.notify_all();
+	load_log_thread.join();
+
+	GuiUpdateTimer::shutdown();
+	LV2World::release();
+}
@@ -21,10 +21,17 @@
 #include <suil/suil.h>
 #include <lv2/ui/ui.h>
 #include <lv2/atom/atom.h>
+#include <lv2/atom/util.h>
+#include <lv2/resize-port/resize-port.h>
 #include <lv2/urid/urid.h>
 #include <lv2/state/state.h>
 #include <lv2/instance-access/instance-access.h>
 #include <lv2/data-access/data-access.h>
+#include <lv2/worker/worker.h>
+#include <lv2/options/options.h>
+#include <lv2/buf-size/buf-size.h>
+#include <lv2/parameters/parameters.h>
+#include <semaphore.h>
 #include <iostream>
 #include <functional>
 #include <stdio.h>
@@ -37,23 +44,42 @@
 #include <math.h>
 #include <vector>
 #include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <deque>
+#include <chrono>
+#include <map>
+#include <set>
 
 #define WARN printf
 
 class LV2Plugin;
 
+class LV2Rack;
+
+/* refreshes the visible plugin UIs, one for the whole module */
 class GuiUpdateTimer : public QObject
 {
 public:
-	GuiUpdateTimer(LV2Plugin *lv2);
-	~GuiUpdateTimer();
+	static GuiUpdateTimer *get(void);
+	static void shutdown(void);
 
-	void start(void);
+	void add(LV2Plugin *lv2);
+	void remove(LV2Plugin *lv2);
 
 protected:
+	GuiUpdateTimer();
+	~GuiUpdateTimer();
+
+	static GuiUpdateTimer *shared;
+
 	void tick(void);
+	void reschedule(void);
 	QTimer *timer = nullptr;
-	LV2Plugin *lv2 = nullptr;
+	std::recursive_mutex lock;
+	std::set<LV2Plugin*> plugins;
 };
 
 class WidgetWindow : public QWidget
@@ -74,22 +100,597 @@ protected:
 
 #define PROTOCOL_FLOAT 0
 
+/* size of our audio buffers, OBS gives us ~400 frames at a time and anything
+ * longer is processed in chunks */
+#define MAX_AUDIO_FRAMES 4096
+
+/* what OBS usually gives us, AUDIO_OUTPUT_FRAMES */
+#define NOMINAL_AUDIO_FRAMES 1024
+
+/* plugins chained in a single filter */
+#define MAX_RACK_SLOTS 8
+
+/* MAX_AUDIO_CHANNELS in OBS, it always hands us that many planes */
+#define MAX_CHANNELS 8
+
+/* length of the crossfade when the instance gets replaced */
+#define CROSSFADE_FRAMES 1024
+
+/* silent blocks run through a fresh instance before it goes live */
+#define WARMUP_BLOCKS 4
+#define WARMUP_FRAMES 1024
+
+/* for atom ports that don't ask for more with rsz:minimumSize */
+#define ATOM_BUFFER_SIZE 8192
+
+/* atom events from the UI that can wait for the audio thread */
+#define ATOM_EVENTS_RING_SIZE 16384
+#define UI_EVENTS_RING_SIZE 65536
+
+/* control changes from the UI that can wait for the audio thread */
+#define CONTROL_QUEUE_SIZE 1024
+
+/* per instance and direction, the biggest message a plugin can pass to or
+ * from its worker */
+#define WORKER_RING_SIZE 8192
+#define WORKER_THREADS 2
+
+/* below that running the copies of a plugin in parallel costs more than it
+ * saves, see LV2Instance::copies */
+#define PARALLEL_MIN_FRAMES 256
+
+/* how much of a block's duration the audio thread waits for the copies on
+ * the DSP threads, the ones that are late are left dry */
+#define PARALLEL_MAX_WAIT 0.5
+
+/* URIDs the module can hand out, 0 is reserved */
+#define URID_TABLE_SIZE 16384
+
+/* blocks waiting for the shared DSP threads, across all the filters */
+#define DSP_QUEUE_SIZE 256
+
+/* how often the UIs are refreshed unless told otherwise, in Hz */
+#define UI_UPDATE_RATE 30.0f
+
+/* percents of the block's duration the load histogram has, the last one
+ * counts everything above */
+#define DSP_LOAD_BUCKETS 201
+
+/* how often the load of the filters gets logged */
+#define DSP_LOAD_LOG_SECONDS 60
+
+/* how long publish() waits for the audio thread before assuming that it's
+ * not running us at all */
+#define DSP_IDLE_MS 100
+
 enum LV2PortType
 {
 	PORT_AUDIO,
 	PORT_CONTROL,
 	PORT_ATOM,
+	PORT_UNKNOWN, /* optional ones we leave unconnected */
+};
+
+/* LV2PortTable::flags */
+#define PORT_INPUT       (1 << 0)
+#define PORT_OPTIONAL    (1 << 1)
+
+/* What the plugin's RDF says about its ports, looked up once by
+ * build_port_table() so nothing has to ask lilv later on, and shared by the
+ * copies of an instance. A column per property, indexed by the port index,
+ * so a loop over the ports touches only what it needs. */
+struct LV2PortTable
+{
+	size_t count = 0;
+	bool in_place_broken = false;
+
+	const char **symbols = nullptr;
+	uint8_t *types = nullptr;
+	uint8_t *flags = nullptr;
+	float *defaults = nullptr;
+	/* rsz:minimumSize, PORT_ATOM only, at least ATOM_BUFFER_SIZE */
+	uint32_t *atom_sizes = nullptr;
+
+	/* open addressing by the symbol's hash, port index + 1 and 0 for
+	 * an empty slot */
+	uint32_t *by_symbol = nullptr;
+	uint32_t *hashes = nullptr;
+	size_t by_symbol_mask = 0;
+
+	/* LV2UI_INVALID_PORT_INDEX if there's no such port */
+	uint32_t find(const char *symbol) const;
+
+	bool is_input(uint32_t idx) const { return this->flags[idx] & PORT_INPUT; }
 };
 
+/* what's going on with a port, the rest is in LV2PortTable */
 struct LV2Port
+{
+	float value;
+
+	/* PORT_ATOM only */
+	LV2_Atom_Sequence *atom;
+	uint32_t atom_capacity;
+};
+
+/* FNV-1a, for the URI and symbol lookups */
+static inline uint32_t hash_string(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	for (const char *c = str; *c != '\0'; ++c) {
+		hash ^= (uint8_t) *c;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* fixed number of threads working through a FIFO of tasks */
+class TaskPool
+{
+public:
+	TaskPool(size_t threads);
+	~TaskPool();
+
+	void submit(std::function<void(void)> task);
+
+protected:
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<std::function<void(void)>> queue;
+	std::vector<std::thread> workers;
+	bool stopping = false;
+
+	void work(void);
+};
+
+struct ControlChange
 {
 	uint32_t index;
-	bool is_input;
-	bool is_optional;
 	float value;
-	float ui_value;
-	const LilvPort* lilv_port;
-	enum LV2PortType type;
+};
+
+/* Wait-free ring for a single producer and a single consumer, neither side
+ * ever blocks - push() fails when it's full. */
+class ControlQueue
+{
+public:
+	ControlQueue(size_t capacity);
+	~ControlQueue();
+
+	bool push(uint32_t index, float value);
+	bool pop(ControlChange *change);
+
+protected:
+	ControlChange *slots = nullptr;
+	size_t mask = 0;
+
+	/* on separate cache lines, each is written by one side only */
+	alignas(64) std::atomic<size_t> head { 0 };
+	alignas(64) std::atomic<size_t> tail { 0 };
+};
+
+/* Same as ControlQueue, but for messages of any size - each is stored as its
+ * size followed by the data. */
+class ByteRing
+{
+public:
+	ByteRing(size_t capacity);
+	~ByteRing();
+
+	bool write(uint32_t size, const void *buf);
+	bool read(uint32_t *size, void *buf, size_t buf_size);
+
+protected:
+	uint8_t *data = nullptr;
+	size_t mask = 0;
+
+	alignas(64) std::atomic<size_t> head { 0 };
+	alignas(64) std::atomic<size_t> tail { 0 };
+
+	void copy_in(size_t pos, const void *src, size_t size);
+	void copy_out(size_t pos, void *dst, size_t size);
+};
+
+/* From the audio thread to the UI, an event for a port in a given protocol.
+ * Instead of failing when full it drops the oldest events, so the audio
+ * thread never waits for the UI - it counts what it dropped. */
+class EventRing : public ByteRing
+{
+public:
+	EventRing(size_t capacity);
+
+	bool push(uint32_t port, uint32_t protocol, uint32_t size, const void *buf);
+	bool pop(uint32_t *port, uint32_t *protocol, uint32_t *size,
+		 void *buf, size_t buf_size);
+
+	uint64_t get_pushed(void);
+	uint64_t get_dropped(void);
+
+protected:
+	std::atomic<uint64_t> pushed { 0 };
+	std::atomic<uint64_t> dropped { 0 };
+};
+
+/* How long processing takes compared to how long the audio it processes
+ * lasts. The audio thread adds a block at a time and never waits, anyone can
+ * read. */
+class DspLoad
+{
+public:
+	struct Stats
+	{
+		uint64_t blocks = 0;
+		uint64_t over_budget = 0;
+		double min_us = 0.0;
+		double mean_us = 0.0;
+		double max_us = 0.0;
+		/* in percents of the blocks' duration */
+		double mean_load = 0.0;
+		double p99_load = 0.0;
+	};
+
+	void add(uint64_t ns, uint64_t budget_ns);
+	Stats get(void);
+
+protected:
+	std::atomic<uint64_t> blocks { 0 };
+	std::atomic<uint64_t> over_budget { 0 };
+	std::atomic<uint64_t> sum_ns { 0 };
+	std::atomic<uint64_t> sum_budget_ns { 0 };
+	std::atomic<uint64_t> min_ns { UINT64_MAX };
+	std::atomic<uint64_t> max_ns { 0 };
+	std::atomic<uint64_t> buckets[DSP_LOAD_BUCKETS] = {};
+};
+
+struct LV2Instance;
+
+/* Threads doing the non-realtime work the plugins schedule with the LV2
+ * worker extension. The audio thread only writes into the instance's ring
+ * and posts a semaphore, it never waits for a worker. */
+class WorkerPool
+{
+public:
+	WorkerPool(size_t threads);
+	~WorkerPool();
+
+	void add(LV2Instance *inst);
+	void remove(LV2Instance *inst);
+	void wake(LV2Instance *inst);
+
+protected:
+	std::mutex lock;
+	std::set<LV2Instance*> instances;
+	std::vector<std::thread> workers;
+	std::atomic<bool> stopping { false };
+	sem_t wakeup;
+
+	LV2Instance *claim(void);
+	void work(void);
+};
+
+/* Threads shared by all the filters that offload their processing, see
+ * LV2Rack::set_offloaded(). Submitting never blocks, so the audio thread can
+ * do it. */
+class DspPool
+{
+public:
+	DspPool(size_t threads);
+	~DspPool();
+
+	bool submit(void (*run)(void *), void *arg);
+
+protected:
+	struct Cell
+	{
+		std::atomic<size_t> seq;
+		void (*run)(void *);
+		void *arg;
+	};
+
+	Cell *cells = nullptr;
+	size_t mask = 0;
+	alignas(64) std::atomic<size_t> enqueue_pos { 0 };
+	alignas(64) std::atomic<size_t> dequeue_pos { 0 };
+
+	std::vector<std::thread> workers;
+	std::atomic<bool> stopping { false };
+	sem_t wakeup;
+
+	bool take(void (**run)(void *), void **arg);
+	void work(void);
+};
+
+/* LV2's URID map and unmap shared by all the plugins. Looking up a URI that's
+ * already mapped and unmapping never lock, they are fine on the audio thread
+ * and the workers. */
+class UridTable
+{
+public:
+	UridTable();
+	~UridTable();
+
+	LV2_URID map(const char *uri);
+	const char *unmap(LV2_URID urid);
+
+	/* for LV2_URID_Map and LV2_URID_Unmap, the handle is the table */
+	static LV2_URID lv2_map(LV2_URID_Map_Handle handle, const char *uri);
+	static const char *lv2_unmap(LV2_URID_Unmap_Handle handle, LV2_URID urid);
+
+protected:
+	struct Entry
+	{
+		char *uri;
+		uint32_t hash;
+		LV2_URID urid;
+	};
+
+	/* open addressing, twice the size so it never fills up */
+	std::atomic<Entry*> *slots = nullptr;
+	/* indexed by the URID */
+	std::atomic<const char*> *uris = nullptr;
+
+	std::mutex insert_lock;
+	LV2_URID next_urid = 1;
+
+	std::atomic<Entry*> *find(const char *uri, uint32_t hash);
+};
+
+struct LV2PluginInfo
+{
+	std::string name;
+	std::string uri;
+	std::string bundle;
+	/* other bundles holding parts of the plugin's data, e.g. its UI */
+	std::vector<std::string> dependencies;
+	std::vector<std::string> required_features;
+	uint32_t audio_inputs;
+	uint32_t audio_outputs;
+	bool has_ui;
+};
+
+/* LilvWorld and the catalog of the plugins we can host, shared by all the
+ * LV2Plugin instances so the bundles are parsed only once per process. It's
+ * reference counted - the module keeps a reference for as long as it's loaded
+ * and each LV2Plugin borrows one for its lifetime. */
+class LV2World
+{
+public:
+	static LV2World *acquire(void);
+	static void release(void);
+
+	/* lilv is not thread safe, anything that touches the world (that
+	 * includes creating and freeing nodes) has to hold the lock */
+	LilvWorld *get_world(void);
+	std::unique_lock<std::mutex> lock_world(void);
+
+	/* loads just the bundles the plugin needs if the catalog knows it,
+	 * takes the world lock itself */
+	const LilvPlugin *get_plugin(const char *uri);
+
+	LilvInstance *instantiate(const LilvPlugin *plugin,
+				  double sample_rate,
+				  const LV2_Feature *const *features);
+	void free_instance(LilvInstance *instance);
+
+	/* for the slow, non-realtime work, e.g. instantiating plugins */
+	TaskPool *get_tasks(void);
+
+	/* for the LV2 worker extension */
+	WorkerPool *get_workers(void);
+
+	/* for the filters that don't run on OBS's audio thread */
+	DspPool *get_dsp_pool(void);
+
+	UridTable *get_urids(void);
+
+	/* returns false if the catalog is still being scanned and only the
+	 * cached part of it was listed */
+	bool for_each_supported_plugin(std::function<void(const char *, const char *)> f);
+
+	/* discovery runs on a background thread, the callback is called from
+	 * that thread once the catalog is complete */
+	void start_scan(void);
+	void set_catalog_ready_callback(std::function<void(void)> f);
+	bool is_catalog_ready(void);
+	void wait_for_catalog(void);
+
+	static bool is_feature_supported(const char *uri);
+	static bool is_plugin_supported(const LV2PluginInfo &info);
+
+	/* where the catalog is cached between runs, empty disables caching */
+	static void set_cache_path(const char *path);
+
+protected:
+	LV2World();
+	~LV2World();
+
+	static LV2World *shared;
+	static size_t refcount;
+	static std::mutex refcount_lock;
+
+	std::mutex world_lock;
+	LilvWorld *world = nullptr;
+	const LilvPlugins *plugins = nullptr;
+	std::set<std::string> loaded_bundles;
+	void load_bundle(const std::string &path);
+	bool load_plugin_bundles(const char *uri);
+
+	/* every plugin found, including those we can't host right now, keyed
+	 * by URI - comes from the cache until the scan is done */
+	std::mutex catalog_lock;
+	std::condition_variable catalog_ready_cond;
+	std::map<std::string,LV2PluginInfo> catalog;
+	std::map<std::string,int64_t> bundle_mtimes;
+	bool catalog_ready = false;
+	std::function<void(void)> catalog_ready_callback;
+
+	TaskPool tasks;
+	WorkerPool workers;
+	DspPool dsp_pool;
+	UridTable urids;
+
+	std::thread scan_thread;
+	std::atomic<bool> scan_abort { false };
+	void scan(void);
+	void populate_catalog(LilvWorld *scan_world);
+	LV2PluginInfo probe_plugin(LilvWorld *scan_world,
+				   const LilvPlugin *plugin,
+				   const std::string &bundle);
+
+	/* CATALOG CACHE */
+	static std::string cache_path;
+	static int64_t bundle_mtime(const std::string &path);
+	bool load_catalog_cache(std::map<std::string,int64_t> &bundles,
+				std::map<std::string,LV2PluginInfo> &plugins);
+	void save_catalog_cache(void);
+};
+
+/* how the source's channels are fed to the plug-in's audio ports and how its
+ * outputs make it back */
+enum RoutingPreset
+{
+	ROUTING_BY_INDEX, /* channel N to port N, copies if there's not enough */
+	ROUTING_DOWNMIX,  /* channels folded into the ports, outputs spread */
+	ROUTING_UPMIX,    /* channels spread over the ports, outputs folded */
+	ROUTING_CUSTOM,
+};
+
+/* gains of the routing matrix, built for a given instance's ports */
+struct LV2Routing
+{
+	size_t channels = 0;
+	size_t inputs = 0;
+	size_t outputs = 0;
+
+	/* a row per input port of gains per channel, and a row per channel of
+	 * gains per output port */
+	float *in = nullptr;
+	float *out = nullptr;
+
+	/* channels no output goes to, they keep the dry signal */
+	bool dry[MAX_CHANNELS];
+
+	/* the mixed output when it can't go straight to OBS, while fading */
+	float *mixed[MAX_CHANNELS];
+};
+
+class LV2Plugin;
+
+/* A plugin instance with its ports and buffers, i.e. everything the audio
+ * thread touches. It's built and torn down off the audio thread and handed
+ * over to it as a whole, see LV2Plugin::publish(). */
+struct LV2Instance
+{
+	const LilvPlugin *plugin = nullptr;
+	LilvInstance *instance = nullptr;
+	bool activated = false;
+	/* the channels it processes, starting at first_channel */
+	size_t channels = 0;
+	size_t first_channel = 0;
+
+	/* COPIES - a plugin with fewer audio ports than the source has
+	 * channels (e.g. a mono one on stereo) gets a copy for each group of
+	 * channels. The first instance owns them, it's the one the UI and the
+	 * state see, and its controls are mirrored to the copies. */
+	LV2Instance *copies[MAX_CHANNELS];
+	size_t copies_count = 0;
+
+	/* a block for a copy run on the module's DSP threads, whoever claims
+	 * it first runs it - the audio thread takes back what nobody did. The
+	 * input is staged in the copy's own buffers, so a job that's late
+	 * never touches OBS's. */
+	LV2Plugin *host = nullptr;
+	int job_frames = 0;
+	std::atomic<bool> job_claimed { true };
+	std::atomic<bool> job_done { true };
+	bool job_skipped = false;
+	std::atomic<size_t> jobs_queued { 0 };
+	LV2Instance *owner = nullptr;
+
+	struct LV2Port *ports = nullptr;
+	size_t ports_count = 0;
+	/* the owner's for the copies */
+	LV2PortTable *port_table = nullptr;
+
+	/* what the input control ports are connected to, owned by whoever
+	 * runs the instance - the UI goes through the queue */
+	float *controls = nullptr;
+	ControlQueue control_changes { CONTROL_QUEUE_SIZE };
+	/* a copy that missed changes while a late job was running it, it
+	 * takes the owner's controls before it's run again */
+	bool controls_stale = false;
+
+	float **input_buffer = nullptr;
+	float **output_buffer = nullptr;
+	size_t input_channels_count = 0;
+	size_t output_channels_count = 0;
+
+	/* audio port indices and what they are connected to right now, either
+	 * our buffers or OBS's ones if the plugin can work in place */
+	uint32_t *input_ports = nullptr;
+	uint32_t *output_ports = nullptr;
+	float **input_connected = nullptr;
+	float **output_connected = nullptr;
+	bool in_place_broken = false;
+
+	/* atom ports and the events from the UI waiting to be put into the
+	 * input sequences */
+	uint32_t *atom_ports = nullptr;
+	size_t atom_ports_count = 0;
+	ByteRing *atom_events = nullptr;
+	void *atom_event = nullptr;
+
+	/* events that didn't fit into their port, counted on the audio thread
+	 * and reported from the UI's */
+	std::atomic<uint64_t> atom_events_dropped { 0 };
+	uint64_t atom_events_dropped_reported = 0;
+
+	/* nullptr if it's by index */
+	LV2Routing *routing = nullptr;
+
+	/* the output control ports for the UI, the audio thread copies those
+	 * that changed and flags them, see LV2Plugin::publish_outputs() */
+	uint32_t *control_outputs = nullptr;
+	size_t control_outputs_count = 0;
+	float *last_outputs = nullptr;
+	std::atomic<float> *output_values = nullptr;
+	std::atomic<uint64_t> *dirty = nullptr;
+	size_t dirty_words = 0;
+
+	/* events of the atom output ports for the UI, and the ports it wants
+	 * to hear about (ui:portNotification) */
+	EventRing *ui_events = nullptr;
+	void *ui_event = nullptr;
+	uint64_t ui_events_dropped = 0;
+	bool *ui_notify = nullptr;
+
+	/* opts:interface, if the plugin has it */
+	const LV2_Options_Interface *options = nullptr;
+
+	/* the minBlockLength and maxBlockLength it knows about */
+	int32_t min_block = 0;
+	int32_t max_block = MAX_AUDIO_FRAMES;
+
+	/* what it was instantiated with, for the audio side, which can't take
+	 * control_lock to look at LV2Plugin::sample_rate */
+	uint32_t sample_rate = 0;
+
+	/* WORKER */
+	const LV2_Worker_Interface *worker = nullptr;
+	WorkerPool *workers = nullptr;
+	ByteRing *worker_requests = nullptr;
+	ByteRing *worker_responses = nullptr;
+	void *worker_response = nullptr;
+	std::atomic<bool> work_pending { false };
+	std::mutex work_lock;
+
+	LV2_Worker_Schedule feature_worker_data;
+	LV2_Feature feature_worker;
+
+	/* LV2Plugin's features plus the per instance ones */
+	const LV2_Feature *features[8];
 };
 
 class LV2Plugin
@@ -98,7 +699,7 @@ public:
 	LV2Plugin(size_t channels);
 	~LV2Plugin();
 
-	void for_each_supported_plugin(std::function<void(const char *, const char *)> f);
+	bool for_each_supported_plugin(std::function<void(const char *, const char *)> f);
 
 	void set_uri(const char* uri);
 	void set_sample_rate(uint32_t sample_rate);
@@ -106,10 +707,42 @@ public:
 
 	size_t get_channels(void);
 
-	void update_plugin_instance(void);
-	void cleanup_plugin_instance(void);
-	void prepare_ports(void);
-	void cleanup_ports(void);
+	/* the block length the plugin is told about, 0 if it's whatever OBS
+	 * hands us - the buffering is done by LV2Rack */
+	void set_block_size(size_t frames);
+
+	/* fades to the dry signal and stops running the instance */
+	void set_bypass(bool bypass);
+
+	/* the matrix is a row per line or ';', gains separated by spaces - for
+	 * the input a row per plug-in's port with a gain per channel and the
+	 * other way around for the output */
+	void set_routing(RoutingPreset preset, const char *input, const char *output);
+
+	/* (re)creates the instance and restores the state on the module's
+	 * task pool, the audio is passed through until it's done */
+	void update_plugin_instance_async(const char *state = nullptr);
+
+	/* deactivates (or frees, keeping the state) the instance of a filter
+	 * on an unused source, resume brings it back - both are async and
+	 * never block, so they are fine to call from any thread */
+	void suspend(bool free_instance);
+	void resume(void);
+	bool is_suspended(void);
+	void wait_for_jobs(void);
+
+	LV2Instance *create_instance(void);
+	void destroy_instance(LV2Instance *inst);
+	void activate_instance(LV2Instance *inst);
+	void deactivate_instance(LV2Instance *inst);
+	void prepare_ports(LV2Instance *inst);
+	LV2PortTable *build_port_table(const LilvPlugin *plugin);
+	void free_port_table(LV2PortTable *table);
+	void cleanup_ports(LV2Instance *inst);
+	/* nullptr connects our own buffers */
+	void connect_audio(LV2Instance *inst, float **buf);
+	/* has to be done before each run() */
+	void prepare_atom_ports(LV2Instance *inst);
 
 	void prepare_ui(void);
 	void show_ui(void);
@@ -119,35 +752,134 @@ public:
 
 	void process_frames(float**, int frames);
 
+	/* of process_frames(), i.e. mostly the plugin's run() */
+	DspLoad::Stats get_dsp_load(void);
+	std::string get_uri(void);
+
 	char *get_state(void);
+	char *serialize_state(void);
 	void set_state(const char *str);
 
-	void notify_ui_output_control_ports(void);
+	/* sends the UI what changed since the last time and lets it idle,
+	 * false if there's no UI to refresh anymore - see GuiUpdateTimer */
+	bool update_ui(void);
+	void set_ui_update_rate(float rate);
+	float get_ui_update_rate(void);
 
 	uint32_t port_index(const char *symbol);
 
+	/* WORKER FEATURE */
+	static LV2_Worker_Status worker_schedule(LV2_Worker_Schedule_Handle handle,
+						 uint32_t size,
+						 const void *data);
+
+	static LV2_Worker_Status worker_respond(LV2_Worker_Respond_Handle handle,
+						uint32_t size,
+						const void *data);
+
+	void deliver_worker_responses(LV2Instance *inst);
+
 protected:
-	bool ready = false;
-	LilvWorld *world;
-	std::vector<std::pair<std::string,std::string>> supported_pluggins;
-	const LilvPlugins *plugins = nullptr;
-	void populate_supported_plugins(void);
+	/* held by whoever reconfigures the instance, ports or the state */
+	std::mutex control_lock;
+	std::condition_variable jobs_done;
+	std::atomic<size_t> pending_jobs { 0 };
+	std::string pending_state;
+	bool has_pending_state = false;
+	std::atomic<bool> suspended { false };
+	std::atomic<bool> free_when_suspended { false };
+	void invalidate_instance(void);
+	void schedule_reconcile(void);
+	void reconcile(void);
+	void keep_state(void);
+	void restore_pending_state(void);
 
-	const LilvPlugin *plugin = nullptr;
-	LilvInstance *plugin_instance = nullptr;
+	LV2World *lv2_world = nullptr;
+	LilvWorld *world = nullptr;
+
+	/* what the UI and the state handling see, replaced only under
+	 * control_lock and never while there's a UI, the UI's thread reads it
+	 * without the lock */
+	std::atomic<LV2Instance*> inst { nullptr };
 
 	char *plugin_uri = nullptr;
 	uint32_t sample_rate = 0;
+
+	/* a copy of plugin_uri for get_uri(), control_lock may be held for
+	 * as long as instantiating takes */
+	std::mutex uri_copy_lock;
+	std::string uri_copy;
 	size_t channels = 0;
 	bool instance_needs_update = true;
 
-	/* PORT MAPPING */
-	struct LV2Port *ports = nullptr;
-	size_t ports_count = 0;
-	float **input_buffer = nullptr;
-	float **output_buffer = nullptr;
-	size_t input_channels_count = 0;
-	size_t output_channels_count = 0;
+	LV2Instance *instantiate(const LilvPlugin *plugin, size_t first_channel,
+				 LV2Instance *owner);
+
+	/* copies through our own buffers, for fading and in-place broken
+	 * plugins */
+	void run_instance(LV2Instance *inst, float **buf, int frames);
+
+	/* ROUTING */
+	RoutingPreset routing_preset = ROUTING_BY_INDEX;
+	std::string routing_input;
+	std::string routing_output;
+	bool routing_changed = false;
+	bool wants_copies(LV2Instance *inst);
+	void update_routing(LV2Instance *inst);
+	static void free_routing(LV2Routing *routing);
+	/* out may be buf, the mixing needs no extra passes */
+	void run_routed(LV2Instance *inst, float **buf, int frames, float **out);
+
+	/* runs the instance and its copies, each on its channels */
+	void run_copies(LV2Instance *inst, float **buf, int frames, bool in_place);
+	void run_copy(LV2Instance *inst, float **buf, int frames, bool in_place);
+	void run_copy_staged(LV2Instance *inst, int frames);
+	static void run_copy_job(void *data);
+	void wait_for_copy_jobs(LV2Instance *inst);
+
+	/* up to MAX_AUDIO_FRAMES */
+	void process_block(float **buf, int frames);
+
+	/* 0 if it's whatever OBS gives us, see LV2Rack */
+	size_t block_size = 0;
+
+	/* the instance is kept, but not given to the audio thread */
+	std::atomic<bool> bypassed { false };
+
+	/* OPTIONS FEATURE */
+	void init_options(void);
+	void update_options(void);
+	void apply_options(LV2Instance *inst);
+	bool options_changed = false;
+
+	int32_t opt_min_block;
+	int32_t opt_max_block;
+	int32_t opt_nominal_block;
+	int32_t opt_sequence_size;
+	float opt_sample_rate;
+	LV2_Options_Option options[6];
+	LV2_Feature feature_options;
+	LV2_Feature feature_bounded_block;
+
+	/* AUDIO THREAD HANDOVER */
+	void publish(LV2Instance *next);
+	void wait_for_handover(LV2Instance *next);
+	std::atomic<LV2Instance*> published { nullptr };
+
+	/* held by the audio thread while processing, it never waits for it -
+	 * publish() takes it only when the audio thread is not running us */
+	std::mutex dsp_lock;
+	LV2Instance *dsp_running = nullptr;
+	LV2Instance *dsp_fading = nullptr;
+	uint32_t fade_pos = 0;
+	bool fading = false;
+
+	DspLoad dsp_load;
+
+	/* reported back by the audio thread after each block */
+	std::atomic<LV2Instance*> dsp_running_seen { nullptr };
+	std::atomic<LV2Instance*> dsp_fading_seen { nullptr };
+	std::atomic<uint64_t> dsp_blocks { 0 };
 
 	/* UI */
 	const LilvUI *ui = nullptr;
@@ -155,8 +887,24 @@ protected:
 	SuilHost *ui_host = nullptr;
 	SuilInstance* ui_instance = nullptr;
 	WidgetWindow *ui_window = nullptr;
+	const LV2UI_Idle_Interface *ui_idle = nullptr;
+	std::atomic<float> ui_update_rate { UI_UPDATE_RATE };
+
+	/* the plugin's features, but with the options for the UI */
+	LV2_Options_Option ui_options[2];
+	float ui_options_rate;
+	LV2_Feature ui_feature_options;
+	LV2_Feature ui_feature_idle;
+	const LV2_Feature *ui_features[9];
 
-	bool is_feature_supported(const LilvNode*);
+	/* the audio thread publishes the outputs only while it's set, and all
+	 * of them once it's asked to resync */
+	std::atomic<bool> ui_listening { false };
+	std::atomic<bool> ui_resync { false };
+	void publish_outputs(LV2Instance *inst);
+	void publish_atom_outputs(LV2Instance *inst);
+	void deliver_ui_events(LV2Instance *inst);
+	void prepare_ui_notifications(LV2Instance *inst);
 
 	static void suil_write_from_ui(void *controller,
 				       uint32_t port_index,
@@ -167,9 +915,16 @@ protected:
 	static uint32_t suil_port_index(void *controller,
 					const char *symbol);
 
-	/* URID MAP FEATURE */
-	std::map<std::string,LV2_URID> urid_map_data;
-	LV2_URID current_urid = 1; /* 0 is reserverd */
+	void write_atom_from_ui(uint32_t port_index,
+				uint32_t buffer_size,
+				const void *buffer);
+
+	/* URID MAP FEATURE, see UridTable */
+	LV2_URID urid_map(const char *uri);
+
+	LV2_URID urid_atom_sequence;
+	LV2_URID urid_atom_chunk;
+	LV2_URID urid_atom_event_transfer;
 
 	LV2_URID_Map feature_uri_map_data;
 	LV2_Feature feature_uri_map;
@@ -182,10 +937,7 @@ protected:
 	LV2_Extension_Data_Feature feature_data_access_data;
 	LV2_Feature feature_data_access;
 
-	static LV2_URID urid_map(void *handle, const char *uri);
-	static const char *urid_unmap(void *handle, LV2_URID urid);
-
-	const LV2_Feature* features[4];
+	const LV2_Feature* features[7];
 
 	/* STATE PERSISTENCE */
 	static const void *get_port_value(const char *port_symbol,
@@ -199,3 +951,124 @@ protected:
 				   uint32_t size,
 				   uint32_t type);
 };
+
+/* An ordered chain of plugins in a single filter. They all run in place on
+ * the same planes one after another, so the chain costs no more copies than a
+ * single plugin. The slots are created as the chain grows and stay around
+ * until the rack is destroyed, the audio thread just looks at how many of
+ * them are in use. */
+class LV2Rack
+{
+public:
+	LV2Rack(size_t channels);
+	~LV2Rack();
+
+	/* creates the slot if needed, not for the audio thread */
+	LV2Plugin *get_slot(size_t idx);
+	/* nullptr if it was never used */
+	LV2Plugin *find_slot(size_t idx);
+
+	void set_slots_count(size_t count);
+	size_t get_slots_count(void);
+
+	/* 0 runs the plugins on whatever OBS hands us, anything else (up to
+	 * MAX_AUDIO_FRAMES) buffers the audio so the plugins always get
+	 * blocks of that size - adds that many frames of latency */
+	void set_block_size(size_t frames);
+
+	/* runs each slot on its own thread, a block behind the one before it,
+	 * so a long chain can use more than one core - adds a block of latency
+	 * per slot and forces fixed blocks */
+	void set_pipelined(bool pipelined);
+
+	/* the whole chain runs on the module's shared DSP threads and OBS
+	 * gets the previous block back - adds a block of latency and forces
+	 * fixed blocks, many filters can then use many cores */
+	void set_offloaded(bool offloaded);
+
+	/* in frames, what the buffering adds on top of the plugins' own */
+	size_t get_latency(void);
+
+	void suspend(bool free_instance);
+	void resume(void);
+	bool is_suspended(void);
+
+	void process_frames(float **buf, int frames);
+
+	/* in Hz, for the UIs of all the slots */
+	void set_ui_update_rate(float rate);
+
+protected:
+	std::mutex control_lock;
+	size_t channels = 0;
+	float ui_update_rate = UI_UPDATE_RATE;
+	std::atomic<bool> suspended { false };
+	std::atomic<bool> free_when_suspended { false };
+
+	std::atomic<LV2Plugin*> slots[MAX_RACK_SLOTS] = {};
+	std::atomic<size_t> slots_count { 1 };
+	void process_slots(float **buf, int frames);
+
+	/* FIXED BLOCK ADAPTER */
+	std::atomic<size_t> block_size { 0 };
+	size_t wanted_block_size = 0;
+	bool block_buffers_allocated = false;
+	size_t update_block_size(void);
+	void apply_block_size(size_t frames);
+	size_t snapshot_slots(LV2Plugin **slots);
+
+	/* audio thread only, once block_size is set */
+	float *block_in[MAX_CHANNELS] = {};
+	float *block_out[MAX_CHANNELS] = {};
+	size_t dsp_block_size = 0;
+	size_t block_fill = 0;
+
+	/* PIPELINE */
+	struct PipelineStage
+	{
+		std::thread thread;
+		sem_t wakeup;
+		float *buf[MAX_CHANNELS];
+	};
+
+	/* a thread per slot in the chain, only while pipelined */
+	std::atomic<bool> pipelined { false };
+	size_t pipeline_threads = 0;
+	std::atomic<size_t> pipeline_ready { 0 };
+	std::atomic<bool> pipeline_stopping { false };
+	PipelineStage pipeline_stages[MAX_RACK_SLOTS];
+	void run_stage(size_t idx);
+	void start_stages(size_t count);
+	void stop_stages(void);
+
+	/* the audio thread is in the middle of a block, see stop_stages() */
+	std::atomic<bool> dsp_in_block { false };
+
+	/* a block more than there are stages, the one that's done moves out
+	 * and the new one moves in */
+	float *pipeline_buffers[MAX_RACK_SLOTS + 1][MAX_CHANNELS] = {};
+
+	/* stages still working on the current tick */
+	std::atomic<size_t> pipeline_pending { 0 };
+
+	/* audio thread only, handed to the stages with their semaphore */
+	size_t pipeline_block = 0;
+	size_t dsp_stages = 0;
+	uint64_t dsp_tick = 0;
+	void process_pipelined(size_t block_size);
+	void allocate_pipeline_buffers(void);
+	bool pipeline_buffers_allocated = false;
+
+	/* OFFLOAD, with its own buffers as the stages may still be working
+	 * on the pipeline's ones after a switch */
+	LV2World *lv2_world = nullptr;
+	std::atomic<bool> offloaded { false };
+	std::atomic<bool> offload_busy { false };
+	float *offload_buffers[2][MAX_CHANNELS] = {};
+	bool offload_buffers_allocated = false;
+	float *offload_buf[MAX_CHANNELS];
+	size_t offload_block = 0;
+	uint64_t offload_tick = 0;
+	void process_offloaded(size_t block_size);
+	static void run_offloaded(void *data);
+};
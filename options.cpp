@@ -0,0 +1,76 @@
+/******************************************************************************
+ *   Copyright (C) 2020 by Arkadiusz Hiler
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+#include "obs-lv2.hpp"
+
+/* block lengths and the sample rate we run the plugin with, plugins use
+ * them to size their buffers and FFTs once */
+void LV2Plugin::init_options(void)
+{
+	LV2_URID urid_int = urid_map(LV2_ATOM__Int);
+	LV2_URID urid_float = urid_map(LV2_ATOM__Float);
+
+	this->options[0] = { LV2_OPTIONS_INSTANCE, 0,
+			     urid_map(LV2_BUF_SIZE__minBlockLength),
+			     sizeof(int32_t), urid_int, &this->opt_min_block };
+	this->options[1] = { LV2_OPTIONS_INSTANCE, 0,
+			     urid_map(LV2_BUF_SIZE__maxBlockLength),
+			     sizeof(int32_t), urid_int, &this->opt_max_block };
+	this->options[2] = { LV2_OPTIONS_INSTANCE, 0,
+			     urid_map(LV2_BUF_SIZE__nominalBlockLength),
+			     sizeof(int32_t), urid_int, &this->opt_nominal_block };
+	this->options[3] = { LV2_OPTIONS_INSTANCE, 0,
+			     urid_map(LV2_BUF_SIZE__sequenceSize),
+			     sizeof(int32_t), urid_int, &this->opt_sequence_size };
+	this->options[4] = { LV2_OPTIONS_INSTANCE, 0,
+			     urid_map(LV2_PARAMETERS__sampleRate),
+			     sizeof(float), urid_float, &this->opt_sample_rate };
+	this->options[5] = { LV2_OPTIONS_INSTANCE, 0, 0, 0, 0, nullptr }; /* terminator */
+
+	feature_options = { LV2_OPTIONS__options, this->options };
+
+	/* process_frames() never goes above maxBlockLength */
+	feature_bounded_block = { LV2_BUF_SIZE__boundedBlockLength, nullptr };
+
+	update_options();
+}
+
+/* has to be called with control_lock held */
+void LV2Plugin::update_options(void)
+{
+	size_t block = this->block_size;
+
+	this->opt_min_block = block;
+	this->opt_max_block = block != 0 ? block : MAX_AUDIO_FRAMES;
+	this->opt_nominal_block = block != 0 ? block : NOMINAL_AUDIO_FRAMES;
+	this->opt_sequence_size = ATOM_BUFFER_SIZE;
+	this->opt_sample_rate = this->sample_rate;
+}
+
+/* opts:interface, the instance must not be running */
+void LV2Plugin::apply_options(LV2Instance *inst)
+{
+	if (inst->options == nullptr || inst->options->set == nullptr)
+		return;
+
+	inst->options->set(lilv_instance_get_handle(inst->instance), this->options);
+	inst->min_block = this->opt_min_block;
+	inst->max_block = this->opt_max_block;
+
+	for (size_t i = 0; i < inst->copies_count; ++i)
+		apply_options(inst->copies[i]);
+}
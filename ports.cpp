@@ -17,68 +17,194 @@
 
 #include "obs-lv2.hpp"
 
-/* XXX: OBS gives us ~400 frames at a time, and internal defines seem to point
- * 1k frames max, this should be safe for now - if stop working we need to
- * either bump it here or change the process_frames to process input in chunks
- */
-#define MAX_AUDIO_FRAMES 4096
+void LV2Plugin::prepare_ports(LV2Instance *inst)
+{
+	if (inst->owner != nullptr)
+		inst->port_table = inst->owner->port_table;
+	else
+		inst->port_table = build_port_table(inst->plugin);
+
+	auto table = inst->port_table;
+
+	inst->in_place_broken = table->in_place_broken;
+
+	inst->ports_count = table->count;
+
+	inst->ports = (LV2Port*) calloc(inst->ports_count, sizeof(*inst->ports));
+	inst->controls = (float*) calloc(inst->ports_count, sizeof(*inst->controls));
+
+	inst->input_channels_count = 0;
+	inst->output_channels_count = 0;
+
+	inst->atom_ports = (uint32_t*) calloc(inst->ports_count, sizeof(*inst->atom_ports));
+	inst->atom_ports_count = 0;
+	bool has_atom_inputs = false;
+	bool has_atom_outputs = false;
+
+	for (size_t i = 0; i < inst->ports_count; ++i) {
+		float def = table->defaults[i];
+
+		inst->ports[i].value = isnan(def) ? 0.0f : def;
+
+		switch (table->types[i]) {
+		case PORT_CONTROL:
+			/* they are always float */
+			inst->controls[i] = inst->ports[i].value;
+
+			if (table->is_input(i)) {
+				lilv_instance_connect_port(inst->instance, i, &inst->controls[i]);
+			} else {
+				lilv_instance_connect_port(inst->instance, i, &inst->ports[i].value);
+				inst->control_outputs_count++;
+			}
+			break;
+		case PORT_AUDIO:
+			if (table->is_input(i))
+				inst->input_channels_count++;
+			else
+				inst->output_channels_count++;
+			break;
+		case PORT_ATOM: {
+			uint32_t capacity = table->atom_sizes[i];
+
+			/* malloc's alignment is more than the 64 bits atoms need */
+			inst->ports[i].atom = (LV2_Atom_Sequence*) calloc(1, capacity);
+			inst->ports[i].atom_capacity = capacity;
+			lilv_instance_connect_port(inst->instance, i, inst->ports[i].atom);
+
+			inst->atom_ports[inst->atom_ports_count++] = i;
+
+			if (table->is_input(i))
+				has_atom_inputs = true;
+			else
+				has_atom_outputs = true;
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	inst->input_buffer = (float**) calloc(inst->input_channels_count, sizeof(*inst->input_buffer));
+	inst->output_buffer = (float**) calloc(inst->output_channels_count, sizeof(*inst->output_buffer));
+	inst->input_ports = (uint32_t*) calloc(inst->input_channels_count, sizeof(*inst->input_ports));
+	inst->output_ports = (uint32_t*) calloc(inst->output_channels_count, sizeof(*inst->output_ports));
+	inst->input_connected = (float**) calloc(inst->input_channels_count, sizeof(*inst->input_connected));
+	inst->output_connected = (float**) calloc(inst->output_channels_count, sizeof(*inst->output_connected));
+
+	size_t in_off = 0;
+	size_t out_off = 0;
+
+	for (size_t i = 0; i < inst->ports_count; ++i) {
+		if (table->types[i] == PORT_AUDIO) {
+			if (table->is_input(i)) {
+				inst->input_buffer[in_off] = (float*) calloc(MAX_AUDIO_FRAMES, sizeof(**inst->input_buffer));
+				inst->input_ports[in_off++] = i;
+			} else {
+				inst->output_buffer[out_off] = (float*) calloc(MAX_AUDIO_FRAMES, sizeof(**inst->output_buffer));
+				inst->output_ports[out_off++] = i;
+			}
+		}
+	}
+
+	connect_audio(inst, nullptr);
 
-void LV2Plugin::prepare_ports(void)
+	inst->control_outputs = (uint32_t*) calloc(inst->control_outputs_count, sizeof(*inst->control_outputs));
+	inst->last_outputs = (float*) calloc(inst->control_outputs_count, sizeof(*inst->last_outputs));
+	inst->output_values = new std::atomic<float>[inst->ports_count]();
+	inst->dirty_words = (inst->ports_count + 63) / 64;
+	inst->dirty = new std::atomic<uint64_t>[inst->dirty_words]();
+
+	for (size_t i = 0, n = 0; i < inst->ports_count; ++i) {
+		if (table->types[i] == PORT_CONTROL && !table->is_input(i)) {
+			inst->last_outputs[n] = inst->ports[i].value;
+			inst->output_values[i] = inst->ports[i].value;
+			inst->control_outputs[n++] = i;
+		}
+	}
+
+	if (has_atom_inputs) {
+		inst->atom_events = new ByteRing(ATOM_EVENTS_RING_SIZE);
+		inst->atom_event = calloc(ATOM_EVENTS_RING_SIZE, 1);
+	}
+
+	/* all of them until a UI says otherwise */
+	inst->ui_notify = (bool*) calloc(inst->ports_count, sizeof(*inst->ui_notify));
+
+	for (size_t i = 0; i < inst->ports_count; ++i)
+		inst->ui_notify[i] = true;
+
+	if (has_atom_outputs) {
+		inst->ui_events = new EventRing(UI_EVENTS_RING_SIZE);
+		inst->ui_event = calloc(UI_EVENTS_RING_SIZE, 1);
+	}
+
+	/* TODO: make sure that we have enough port for our samples */
+}
+
+LV2PortTable *LV2Plugin::build_port_table(const LilvPlugin *plugin)
 {
+	auto world_guard = lv2_world->lock_world();
+
 	LilvNode* input_port   = lilv_new_uri(world, LV2_CORE__InputPort);
 	LilvNode* output_port  = lilv_new_uri(world, LV2_CORE__OutputPort);
 	LilvNode* audio_port   = lilv_new_uri(world, LV2_CORE__AudioPort);
 	LilvNode* control_port = lilv_new_uri(world, LV2_CORE__ControlPort);
 	LilvNode* atom_port    = lilv_new_uri(world, LV2_ATOM__AtomPort);
 	LilvNode* optional     = lilv_new_uri(world, LV2_CORE__connectionOptional);
+	LilvNode* minimum_size = lilv_new_uri(world, LV2_RESIZE_PORT__minimumSize);
+	LilvNode* in_place_broken = lilv_new_uri(world, LV2_CORE__inPlaceBroken);
 
-	this->ports_count = lilv_plugin_get_num_ports(this->plugin);
+	auto table = new LV2PortTable();
+	size_t count = lilv_plugin_get_num_ports(plugin);
 
-	this->ports = (LV2Port*) calloc(this->ports_count, sizeof(*this->ports));
+	table->count = count;
+	table->in_place_broken = lilv_plugin_has_feature(plugin, in_place_broken);
+	table->symbols = (const char**) calloc(count, sizeof(*table->symbols));
+	table->types = (uint8_t*) calloc(count, sizeof(*table->types));
+	table->flags = (uint8_t*) calloc(count, sizeof(*table->flags));
+	table->defaults = (float*) calloc(count, sizeof(*table->defaults));
+	table->atom_sizes = (uint32_t*) calloc(count, sizeof(*table->atom_sizes));
 
-	float* default_values = (float*)calloc(this->ports_count, sizeof(float));
-	lilv_plugin_get_port_ranges_float(this->plugin, NULL, NULL, default_values);
+	lilv_plugin_get_port_ranges_float(plugin, nullptr, nullptr, table->defaults);
 
-	input_channels_count = 0;
-	output_channels_count = 0;
+	for (size_t i = 0; i < count; ++i) {
+		auto port = lilv_plugin_get_port_by_index(plugin, i);
 
-	for (size_t i = 0; i < this->ports_count; ++i) {
-		auto port = lilv_plugin_get_port_by_index(this->plugin, i);
+		/* owned by the plugin, lives as long as the world */
+		table->symbols[i] = lilv_node_as_string(lilv_port_get_symbol(plugin, port));
 
-		this->ports[i].is_optional = lilv_port_has_property(this->plugin, port, optional);
-		this->ports[i].value = isnan(default_values[i]) ? 0.0f : default_values[i];
-		this->ports[i].lilv_port = port;
-		this->ports[i].index = i;
-		this->ports[i].ui_value = NAN;
-
-		if (lilv_port_is_a(this->plugin, port, input_port)) {
-			this->ports[i].is_input = true;
-		} else if (lilv_port_is_a(this->plugin, port, output_port)) {
-			this->ports[i].is_input = false;
-		} else {
+		if (lilv_port_is_a(plugin, port, input_port)) {
+			table->flags[i] |= PORT_INPUT;
+		} else if (!lilv_port_is_a(plugin, port, output_port)) {
 			printf("No idea what to do with a port that is neither an input nor output\n");
 			abort(); /* XXX: check spec and be less harsh */
 		}
 
-		if (lilv_port_is_a(this->plugin, port, control_port)) {
-			/* they are always float */
-			this->ports[i].type = PORT_CONTROL;
-			lilv_instance_connect_port(this->plugin_instance, i, &this->ports[i].value);
-		} else if (lilv_port_is_a(this->plugin, port, audio_port)) {
-			this->ports[i].type = PORT_AUDIO;
+		if (lilv_port_has_property(plugin, port, optional))
+			table->flags[i] |= PORT_OPTIONAL;
 
-			if (this->ports[i].is_input)
-				this->input_channels_count++;
-			else
-				this->output_channels_count++;
-		} else if (lilv_port_is_a(this->plugin, port, atom_port)) {
-			/* TODO: some plugins seem to have atom port what are those? */
-			/* everything seems to be working if we ignore them */
-			this->ports[i].type = PORT_ATOM;
-		} else if (!this->ports[i].is_optional){
-			auto name = lilv_port_get_name(this->plugin, port);
+		if (lilv_port_is_a(plugin, port, control_port)) {
+			table->types[i] = PORT_CONTROL;
+		} else if (lilv_port_is_a(plugin, port, audio_port)) {
+			table->types[i] = PORT_AUDIO;
+		} else if (lilv_port_is_a(plugin, port, atom_port)) {
+			table->types[i] = PORT_ATOM;
+			table->atom_sizes[i] = ATOM_BUFFER_SIZE;
+
+			auto size = lilv_port_get(plugin, port, minimum_size);
+
+			if (size != nullptr && lilv_node_is_int(size) &&
+			    lilv_node_as_int(size) > (int) table->atom_sizes[i])
+				table->atom_sizes[i] = lilv_node_as_int(size);
+
+			lilv_node_free(size);
+		} else if (table->flags[i] & PORT_OPTIONAL) {
+			table->types[i] = PORT_UNKNOWN;
+		} else {
+			auto name = lilv_port_get_name(plugin, port);
 			printf("No idea what to do with a port \"%s\" that is neither an audio nor control and is not optional\n", lilv_node_as_string(name));
-			auto classes = lilv_port_get_classes(this->plugin, port);
+			auto classes = lilv_port_get_classes(plugin, port);
 			LILV_FOREACH(nodes, j, classes) {
 				auto cls = lilv_nodes_get(classes, j);
 				printf("  class: %s\n", lilv_node_as_string(cls));
@@ -87,73 +213,609 @@ void LV2Plugin::prepare_ports(void)
 		}
 	}
 
-	this->input_buffer = (float**) calloc(input_channels_count, sizeof(*input_buffer));
-	this->output_buffer = (float**) calloc(output_channels_count, sizeof(*output_buffer));
+	/* at most half full, so a lookup finds an empty slot quickly */
+	size_t size = 1;
 
-	size_t in_off = 0;
-	size_t out_off = 0;
+	while (size < count * 2)
+		size <<= 1;
 
-	for (size_t i = 0; i < this->ports_count; ++i) {
-		if (this->ports[i].type == PORT_AUDIO) {
-			if (this->ports[i].is_input) {
-				input_buffer[in_off] = (float*) calloc(MAX_AUDIO_FRAMES, sizeof(**input_buffer));
-				lilv_instance_connect_port(this->plugin_instance, i, input_buffer[in_off++]);
-			} else {
-				output_buffer[out_off] = (float*) calloc(MAX_AUDIO_FRAMES, sizeof(**output_buffer));
-				lilv_instance_connect_port(this->plugin_instance, i, output_buffer[out_off++]);
-			}
-		}
-	}
+	table->by_symbol = (uint32_t*) calloc(size, sizeof(*table->by_symbol));
+	table->hashes = (uint32_t*) calloc(count, sizeof(*table->hashes));
+	table->by_symbol_mask = size - 1;
 
-	/* TODO: make sure that we have enough port for our samples */
+	for (size_t i = 0; i < count; ++i) {
+		table->hashes[i] = hash_string(table->symbols[i]);
+
+		size_t slot = table->hashes[i] & table->by_symbol_mask;
+
+		while (table->by_symbol[slot] != 0)
+			slot = (slot + 1) & table->by_symbol_mask;
 
-	free(default_values);
+		table->by_symbol[slot] = i + 1;
+	}
 
+	lilv_node_free(in_place_broken);
+	lilv_node_free(minimum_size);
 	lilv_node_free(optional);
 	lilv_node_free(atom_port);
 	lilv_node_free(control_port);
 	lilv_node_free(audio_port);
 	lilv_node_free(output_port);
 	lilv_node_free(input_port);
+
+	return table;
 }
 
+void LV2Plugin::free_port_table(LV2PortTable *table)
+{
+	free(table->symbols);
+	free(table->types);
+	free(table->flags);
+	free(table->defaults);
+	free(table->atom_sizes);
+	free(table->by_symbol);
+	free(table->hashes);
+
+	delete table;
+}
 
-void LV2Plugin::cleanup_ports(void)
+uint32_t LV2PortTable::find(const char *symbol) const
 {
-	for (size_t i = 0; i < this->input_channels_count; i++)
-		free(this->input_buffer[i]);
+	if (this->by_symbol == nullptr)
+		return LV2UI_INVALID_PORT_INDEX;
 
-	for (size_t i = 0; i < this->output_channels_count; i++)
-		free(this->output_buffer[i]);
+	uint32_t hash = hash_string(symbol);
 
-	free(this->input_buffer);
-	free(this->output_buffer);
+	for (size_t slot = hash & this->by_symbol_mask;; slot = (slot + 1) & this->by_symbol_mask) {
+		uint32_t entry = this->by_symbol[slot];
 
-	this->input_buffer = nullptr;
-	this->output_buffer = nullptr;
+		if (entry == 0)
+			return LV2UI_INVALID_PORT_INDEX;
 
-	free(this->ports);
-	this->ports = nullptr;
+		if (this->hashes[entry - 1] == hash && !strcmp(this->symbols[entry - 1], symbol))
+			return entry - 1;
+	}
 }
 
-void LV2Plugin::process_frames(float** buf, int frames)
+
+void LV2Plugin::cleanup_ports(LV2Instance *inst)
+{
+	for (size_t i = 0; i < inst->input_channels_count; i++)
+		free(inst->input_buffer[i]);
+
+	for (size_t i = 0; i < inst->output_channels_count; i++)
+		free(inst->output_buffer[i]);
+
+	free(inst->input_buffer);
+	free(inst->output_buffer);
+
+	inst->input_buffer = nullptr;
+	inst->output_buffer = nullptr;
+
+	free(inst->input_ports);
+	free(inst->output_ports);
+	free(inst->input_connected);
+	free(inst->output_connected);
+
+	inst->input_ports = nullptr;
+	inst->output_ports = nullptr;
+	inst->input_connected = nullptr;
+	inst->output_connected = nullptr;
+
+	for (size_t i = 0; i < inst->atom_ports_count; i++)
+		free(inst->ports[inst->atom_ports[i]].atom);
+
+	free(inst->atom_ports);
+	inst->atom_ports = nullptr;
+	inst->atom_ports_count = 0;
+
+	delete inst->atom_events;
+	free(inst->atom_event);
+	inst->atom_events = nullptr;
+	inst->atom_event = nullptr;
+
+	delete inst->ui_events;
+	free(inst->ui_event);
+	free(inst->ui_notify);
+	inst->ui_events = nullptr;
+	inst->ui_event = nullptr;
+	inst->ui_notify = nullptr;
+
+	free(inst->controls);
+	inst->controls = nullptr;
+
+	free(inst->control_outputs);
+	free(inst->last_outputs);
+	delete[] inst->output_values;
+	delete[] inst->dirty;
+	inst->control_outputs = nullptr;
+	inst->last_outputs = nullptr;
+	inst->output_values = nullptr;
+	inst->dirty = nullptr;
+	inst->control_outputs_count = 0;
+	inst->dirty_words = 0;
+
+	free(inst->ports);
+	inst->ports = nullptr;
+
+	/* the copies go first, see destroy_instance() */
+	if (inst->owner == nullptr && inst->port_table != nullptr)
+		free_port_table(inst->port_table);
+
+	inst->port_table = nullptr;
+}
+
+/* Connecting is cheap but not free for every plugin, so it's done only when
+ * the pointers change - OBS tends to reuse its buffers between blocks. The
+ * channels we don't feed stay on our own buffers. */
+void LV2Plugin::connect_audio(LV2Instance *inst, float **buf)
+{
+	for (size_t ch = 0; ch < inst->input_channels_count; ++ch) {
+		float *data = inst->input_buffer[ch];
+
+		if (buf != nullptr && ch < inst->channels)
+			data = buf[ch];
+
+		if (inst->input_connected[ch] != data) {
+			lilv_instance_connect_port(inst->instance, inst->input_ports[ch], data);
+			inst->input_connected[ch] = data;
+		}
+	}
+
+	for (size_t ch = 0; ch < inst->output_channels_count; ++ch) {
+		float *data = inst->output_buffer[ch];
+
+		if (buf != nullptr && ch < inst->channels)
+			data = buf[ch];
+
+		if (inst->output_connected[ch] != data) {
+			lilv_instance_connect_port(inst->instance, inst->output_ports[ch], data);
+			inst->output_connected[ch] = data;
+		}
+	}
+}
+
+/* Empties the input sequences and gives the plugin the whole buffer for the
+ * output ones, then puts in whatever the UI has sent since the last run.
+ * Nothing gets allocated, events that don't fit are dropped.
+ * Runs wherever the instance is run, like apply_control_changes(). */
+void LV2Plugin::prepare_atom_ports(LV2Instance *inst)
 {
-	/* XXX: may need proper locking */
-	if (!this->ready || this->plugin_instance == nullptr)
+	for (size_t i = 0; i < inst->atom_ports_count; ++i) {
+		auto port = inst->ports + inst->atom_ports[i];
+
+		if (inst->port_table->is_input(inst->atom_ports[i])) {
+			port->atom->atom.type = this->urid_atom_sequence;
+			port->atom->atom.size = sizeof(LV2_Atom_Sequence_Body);
+			port->atom->body.unit = 0;
+			port->atom->body.pad = 0;
+		} else {
+			port->atom->atom.type = this->urid_atom_chunk;
+			port->atom->atom.size = port->atom_capacity - sizeof(LV2_Atom);
+		}
+	}
+
+	if (inst->atom_events == nullptr)
 		return;
 
-	if (frames > MAX_AUDIO_FRAMES) {
-		printf("too many frames at once, FIXME!\n");
-		abort();
+	uint32_t size;
+
+	/* the port index, padding to keep the event aligned and the event */
+	while (inst->atom_events->read(&size, inst->atom_event, ATOM_EVENTS_RING_SIZE)) {
+		const size_t header = 2 * sizeof(uint32_t) + sizeof(LV2_Atom_Event);
+
+		if (size < header)
+			continue;
+
+		uint32_t idx = *((uint32_t*) inst->atom_event);
+		auto ev = (LV2_Atom_Event*) ((uint8_t*) inst->atom_event + 2 * sizeof(uint32_t));
+
+		/* the atom has to be all there, the append copies as much as
+		 * it claims to be */
+		if (idx >= inst->ports_count || ev->body.size > size - header)
+			continue;
+
+		auto port = inst->ports + idx;
+
+		if (!lv2_atom_sequence_append_event(port->atom, port->atom_capacity, ev))
+			inst->atom_events_dropped.fetch_add(1, std::memory_order_relaxed);
 	}
+}
 
-	size_t chs = std::min(this->channels, this->input_channels_count);
-	for (size_t ch = 0; ch < chs; ++ch)
-		memcpy(input_buffer[ch], buf[ch], frames * sizeof(**buf));
+/* audio thread side of suil_write_from_ui() */
+static inline void apply_control_changes(LV2Instance *inst)
+{
+	ControlChange change;
+
+	if (inst == nullptr)
+		return;
+
+	while (inst->control_changes.pop(&change)) {
+		inst->controls[change.index] = change.value;
+
+		/* a late job may still be running a copy, it catches up in
+		 * sync_copy_controls() */
+		for (size_t i = 0; i < inst->copies_count; ++i) {
+			auto copy = inst->copies[i];
+
+			if (copy->job_done.load(std::memory_order_acquire))
+				copy->controls[change.index] = change.value;
+			else
+				copy->controls_stale = true;
+		}
+	}
+}
+
+/* only for a copy that's done, right before it's run */
+static inline void sync_copy_controls(LV2Instance *copy)
+{
+	if (!copy->controls_stale)
+		return;
+
+	memcpy(copy->controls, copy->owner->controls, copy->ports_count * sizeof(*copy->controls));
+	copy->controls_stale = false;
+}
+
+/* all the channels of an instance and its copies */
+static inline size_t instance_channels(LV2Instance *inst)
+{
+	size_t chs = inst->channels;
+
+	for (size_t i = 0; i < inst->copies_count; ++i)
+		chs += inst->copies[i]->channels;
+
+	return chs;
+}
+
+/* the output of an instance for the given channel, dry signal if there's no
+ * instance or it has no output for that channel */
+static inline const float *instance_output(LV2Instance *inst, float **buf, size_t ch)
+{
+	if (inst == nullptr)
+		return buf[ch];
+
+	if (inst->routing != nullptr) {
+		if (ch >= inst->routing->channels || inst->routing->dry[ch])
+			return buf[ch];
+
+		return inst->routing->mixed[ch];
+	}
+
+	/* they are in the order of their channels, one a late job is still
+	 * running stays dry */
+	for (size_t i = inst->copies_count; i > 0; --i) {
+		auto copy = inst->copies[i - 1];
+
+		if (ch < copy->first_channel)
+			continue;
+
+		if (!copy->job_done.load(std::memory_order_acquire))
+			return buf[ch];
+
+		return instance_output(copy, buf, ch);
+	}
+
+	size_t idx = ch - inst->first_channel;
+
+	if (idx >= std::min(inst->channels, inst->output_channels_count))
+		return buf[ch];
+
+	return inst->output_buffer[idx];
+}
+
+void LV2Plugin::run_instance(LV2Instance *inst, float **buf, int frames)
+{
+	if (inst == nullptr)
+		return;
 
-	lilv_instance_run(this->plugin_instance, frames);
+	if (inst->routing != nullptr) {
+		run_routed(inst, buf, frames, inst->routing->mixed);
+		return;
+	}
+
+	if (inst->copies_count > 0) {
+		run_copies(inst, buf, frames, false);
+		return;
+	}
+
+	connect_audio(inst, nullptr);
 
-	chs = std::min(this->channels, this->output_channels_count);
+	size_t chs = std::min(inst->channels, inst->input_channels_count);
 	for (size_t ch = 0; ch < chs; ++ch)
-		memcpy(buf[ch], output_buffer[ch], frames * sizeof(**buf));
+		memcpy(inst->input_buffer[ch], buf[ch], frames * sizeof(**buf));
+
+	prepare_atom_ports(inst);
+	lilv_instance_run(inst->instance, frames);
+	deliver_worker_responses(inst);
+}
+
+void LV2Plugin::process_frames(float** buf, int frames)
+{
+	/* never wait here, publish() takes it only if we are not running */
+	std::unique_lock<std::mutex> dsp_guard(this->dsp_lock, std::try_to_lock);
+
+	if (!dsp_guard.owns_lock())
+		return;
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (int off = 0; off < frames; off += MAX_AUDIO_FRAMES) {
+		float *chunk[MAX_CHANNELS];
+
+		for (size_t ch = 0; ch < MAX_CHANNELS; ++ch)
+			chunk[ch] = buf[ch] != nullptr ? buf[ch] + off : nullptr;
+
+		process_block(chunk, std::min(frames - off, MAX_AUDIO_FRAMES));
+	}
+
+	/* only when there's something running, passing through costs
+	 * nothing worth counting */
+	LV2Instance *running = this->dsp_running;
+
+	if (running != nullptr && running->sample_rate != 0) {
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count();
+
+		this->dsp_load.add(ns, (uint64_t) frames * 1000000000 / running->sample_rate);
+	}
+
+	/* fading first, publish() relies on that order */
+	this->dsp_fading_seen.store(this->dsp_fading, std::memory_order_release);
+	this->dsp_running_seen.store(this->dsp_running, std::memory_order_release);
+	this->dsp_blocks++;
+}
+
+void LV2Plugin::process_block(float** buf, int frames)
+{
+	auto next = this->published.load(std::memory_order_acquire);
+
+	/* a fade is never interrupted, publish() waits for it to finish */
+	if (next != this->dsp_running && !this->fading) {
+		this->dsp_fading = this->dsp_running;
+		this->dsp_running = next;
+		this->fade_pos = 0;
+		this->fading = true;
+	}
+
+	auto cur = this->dsp_running;
+	auto old = this->dsp_fading;
+
+	/* the block length may have just changed, and the instances may not
+	 * know about it yet */
+	int limit = std::min(cur != nullptr ? cur->max_block : MAX_AUDIO_FRAMES,
+			     old != nullptr ? old->max_block : MAX_AUDIO_FRAMES);
+
+	if (frames > limit) {
+		for (int off = 0; off < frames; off += limit) {
+			float *chunk[MAX_CHANNELS];
+
+			for (size_t ch = 0; ch < MAX_CHANNELS; ++ch)
+				chunk[ch] = buf[ch] != nullptr ? buf[ch] + off : nullptr;
+
+			process_block(chunk, std::min(frames - off, limit));
+		}
+
+		return;
+	}
+
+	apply_control_changes(cur);
+
+	if (!this->fading) {
+		if (cur != nullptr && cur->routing != nullptr) {
+			run_routed(cur, buf, frames, buf);
+		} else if (cur != nullptr && !cur->in_place_broken) {
+			/* straight from and into OBS's buffers */
+			run_copies(cur, buf, frames, true);
+		} else if (cur != nullptr) {
+			run_instance(cur, buf, frames);
+
+			size_t chs = instance_channels(cur);
+			for (size_t ch = 0; ch < chs; ++ch) {
+				auto out = instance_output(cur, buf, ch);
+
+				if (out != buf[ch])
+					memcpy(buf[ch], out, frames * sizeof(**buf));
+			}
+		}
+	} else {
+		/* both outputs and the dry signal are needed for the fade */
+		run_instance(cur, buf, frames);
+		run_instance(old, buf, frames);
+
+		/* equal gain is fine, both sides are mostly the same signal */
+		size_t chs = instance_channels(cur != nullptr ? cur : old);
+
+		for (size_t ch = 0; ch < chs; ++ch) {
+			auto from = instance_output(old, buf, ch);
+			auto to = instance_output(cur, buf, ch);
+
+			for (int i = 0; i < frames; ++i) {
+				float g = std::min(1.0f, (float) (this->fade_pos + i) / CROSSFADE_FRAMES);
+				buf[ch][i] = from[i] + (to[i] - from[i]) * g;
+			}
+		}
+
+		this->fade_pos += frames;
+
+		if (this->fade_pos >= CROSSFADE_FRAMES) {
+			this->fading = false;
+			this->dsp_fading = nullptr;
+		}
+	}
+
+	if (cur != nullptr)
+		publish_outputs(cur);
+}
+
+/* Hands the output control ports that changed over to the UI thread, it
+ * never reads what the plugin writes into directly. Only while there's a UI
+ * to show them. */
+void LV2Plugin::publish_outputs(LV2Instance *inst)
+{
+	/* ui_notify is set up before it's set */
+	if (!this->ui_listening.load(std::memory_order_acquire))
+		return;
+
+	bool resync = this->ui_resync.exchange(false, std::memory_order_relaxed);
+
+	for (size_t n = 0; n < inst->control_outputs_count; ++n) {
+		uint32_t idx = inst->control_outputs[n];
+		float value = inst->ports[idx].value;
+
+		if (!inst->ui_notify[idx])
+			continue;
+
+		if (value == inst->last_outputs[n] && !resync)
+			continue;
+
+		inst->last_outputs[n] = value;
+		inst->output_values[idx].store(value, std::memory_order_relaxed);
+		inst->dirty[idx / 64].fetch_or(1ull << (idx % 64), std::memory_order_release);
+	}
+
+	publish_atom_outputs(inst);
+}
+
+/* a single instance on its channels of buf */
+void LV2Plugin::run_copy(LV2Instance *inst, float **buf, int frames, bool in_place)
+{
+	float **chunk = buf + inst->first_channel;
+
+	if (!in_place) {
+		connect_audio(inst, nullptr);
+
+		size_t chs = std::min(inst->channels, inst->input_channels_count);
+		for (size_t ch = 0; ch < chs; ++ch)
+			memcpy(inst->input_buffer[ch], chunk[ch], frames * sizeof(**buf));
+	} else {
+		connect_audio(inst, chunk);
+	}
+
+	prepare_atom_ports(inst);
+	lilv_instance_run(inst->instance, frames);
+	deliver_worker_responses(inst);
+}
+
+/* a copy with the input already in its buffers, see run_copies() */
+void LV2Plugin::run_copy_staged(LV2Instance *inst, int frames)
+{
+	connect_audio(inst, nullptr);
+	prepare_atom_ports(inst);
+	lilv_instance_run(inst->instance, frames);
+	deliver_worker_responses(inst);
+}
+
+void LV2Plugin::run_copy_job(void *data)
+{
+	LV2Instance *copy = (LV2Instance*) data;
+
+	if (!copy->job_claimed.exchange(true, std::memory_order_acq_rel)) {
+		copy->host->run_copy_staged(copy, copy->job_frames);
+		copy->job_done.store(true, std::memory_order_release);
+	}
+
+	copy->jobs_queued.fetch_sub(1, std::memory_order_release);
+}
+
+/* The copies are independent of each other, so with blocks long enough to be
+ * worth it they go to the module's DSP threads while we run the first
+ * instance. Whatever no thread has picked up by then we run ourselves, and
+ * the ones a thread is still running get a bounded wait - after that their
+ * channels stay dry, for as long as they take to finish. Only in place, the
+ * fade reads the copies' own output buffers. */
+void LV2Plugin::run_copies(LV2Instance *inst, float **buf, int frames, bool in_place)
+{
+	uint32_t sample_rate = inst->sample_rate;
+	bool parallel = in_place && frames >= PARALLEL_MIN_FRAMES && sample_rate != 0;
+
+	if (!parallel) {
+		run_copy(inst, buf, frames, in_place);
+
+		/* one we gave up on earlier stays dry until it's done */
+		for (size_t i = 0; i < inst->copies_count; ++i) {
+			auto copy = inst->copies[i];
+
+			if (!copy->job_done.load(std::memory_order_acquire))
+				continue;
+
+			sync_copy_controls(copy);
+			run_copy(copy, buf, frames, in_place);
+		}
+
+		return;
+	}
+
+	auto pool = this->lv2_world->get_dsp_pool();
+
+	for (size_t i = 0; i < inst->copies_count; ++i) {
+		auto copy = inst->copies[i];
+
+		copy->job_skipped = !copy->job_done.load(std::memory_order_acquire);
+
+		if (copy->job_skipped)
+			continue;
+
+		sync_copy_controls(copy);
+
+		size_t chs = std::min(copy->channels, copy->input_channels_count);
+		for (size_t ch = 0; ch < chs; ++ch)
+			memcpy(copy->input_buffer[ch], buf[copy->first_channel + ch], frames * sizeof(**buf));
+
+		/* a job left over from an earlier block may pick it up as
+		 * soon as it's unclaimed */
+		copy->job_frames = frames;
+		copy->job_done.store(false, std::memory_order_relaxed);
+		copy->job_claimed.store(false, std::memory_order_release);
+
+		copy->jobs_queued.fetch_add(1, std::memory_order_relaxed);
+
+		if (!pool->submit(LV2Plugin::run_copy_job, copy))
+			copy->jobs_queued.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	run_copy(inst, buf, frames, in_place);
+
+	for (size_t i = 0; i < inst->copies_count; ++i) {
+		auto copy = inst->copies[i];
+
+		if (copy->job_skipped || copy->job_claimed.exchange(true, std::memory_order_acq_rel))
+			continue;
+
+		run_copy_staged(copy, frames);
+		copy->job_done.store(true, std::memory_order_relaxed);
+	}
+
+	auto deadline = std::chrono::steady_clock::now() +
+		std::chrono::nanoseconds((uint64_t) (frames * PARALLEL_MAX_WAIT * 1e9 / sample_rate));
+
+	for (size_t i = 0; i < inst->copies_count; ++i) {
+		auto copy = inst->copies[i];
+
+		if (copy->job_skipped)
+			continue;
+
+		while (!copy->job_done.load(std::memory_order_acquire) &&
+		       std::chrono::steady_clock::now() < deadline)
+			std::this_thread::yield();
+
+		if (!copy->job_done.load(std::memory_order_acquire))
+			continue;
+
+		size_t chs = std::min(copy->channels, copy->output_channels_count);
+		for (size_t ch = 0; ch < chs; ++ch)
+			memcpy(buf[copy->first_channel + ch], copy->output_buffer[ch], frames * sizeof(**buf));
+	}
+}
+
+/* a job the audio thread has given up on may still be running the copies,
+ * nothing else may touch them until it's done */
+void LV2Plugin::wait_for_copy_jobs(LV2Instance *inst)
+{
+	if (inst == nullptr)
+		return;
+
+	for (size_t i = 0; i < inst->copies_count; ++i) {
+		while (inst->copies[i]->jobs_queued > 0)
+			std::this_thread::yield();
+	}
 }
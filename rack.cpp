@@ -0,0 +1,517 @@
+/******************************************************************************
+ *   Copyright (C) 2020 by Arkadiusz Hiler
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+#include "obs-lv2.hpp"
+
+using namespace std;
+
+LV2Rack::LV2Rack(size_t channels)
+{
+	this->channels = channels;
+	this->lv2_world = LV2World::acquire();
+}
+
+LV2Rack::~LV2Rack()
+{
+	/* OBS is done with us, but the last block may still be in the pool */
+	while (this->offload_busy)
+		this_thread::sleep_for(chrono::milliseconds(1));
+
+	stop_stages();
+
+	if (this->pipeline_buffers_allocated) {
+		for (auto &buffer: this->pipeline_buffers) {
+			for (size_t ch = 0; ch < MAX_CHANNELS; ++ch)
+				free(buffer[ch]);
+		}
+	}
+
+	if (this->offload_buffers_allocated) {
+		for (auto &buffer: this->offload_buffers) {
+			for (size_t ch = 0; ch < MAX_CHANNELS; ++ch)
+				free(buffer[ch]);
+		}
+	}
+
+	for (size_t i = 0; i < MAX_RACK_SLOTS; ++i)
+		delete this->slots[i].load();
+
+	for (size_t ch = 0; ch < MAX_CHANNELS; ++ch) {
+		free(this->block_in[ch]);
+		free(this->block_out[ch]);
+	}
+
+	LV2World::release();
+}
+
+LV2Plugin *LV2Rack::get_slot(size_t idx)
+{
+	lock_guard<mutex> guard(this->control_lock);
+
+	if (idx >= MAX_RACK_SLOTS)
+		return nullptr;
+
+	LV2Plugin *slot = this->slots[idx];
+
+	if (slot == nullptr) {
+		slot = new LV2Plugin(this->channels);
+		slot->set_block_size(this->block_size);
+		slot->set_ui_update_rate(this->ui_update_rate);
+
+		/* follows the rest of the chain until it's told otherwise */
+		if (this->suspended)
+			slot->suspend(this->free_when_suspended);
+
+		this->slots[idx].store(slot, memory_order_release);
+	}
+
+	return slot;
+}
+
+LV2Plugin *LV2Rack::find_slot(size_t idx)
+{
+	if (idx >= MAX_RACK_SLOTS)
+		return nullptr;
+
+	return this->slots[idx];
+}
+
+void LV2Rack::set_slots_count(size_t count)
+{
+	count = max((size_t) 1, min(count, (size_t) MAX_RACK_SLOTS));
+
+	/* the audio thread may look at them as soon as the count is there */
+	for (size_t i = 0; i < count; ++i)
+		get_slot(i);
+
+	{
+		lock_guard<mutex> guard(this->control_lock);
+
+		if (this->pipelined)
+			start_stages(count);
+	}
+
+	this->slots_count.store(count, memory_order_release);
+}
+
+size_t LV2Rack::get_slots_count(void)
+{
+	return this->slots_count;
+}
+
+void LV2Rack::set_block_size(size_t frames)
+{
+	size_t block_size;
+
+	{
+		lock_guard<mutex> guard(this->control_lock);
+
+		this->wanted_block_size = min(frames, (size_t) MAX_AUDIO_FRAMES);
+		block_size = update_block_size();
+	}
+
+	apply_block_size(block_size);
+}
+
+void LV2Rack::set_pipelined(bool pipelined)
+{
+	size_t block_size;
+
+	{
+		lock_guard<mutex> guard(this->control_lock);
+
+		/* the buffers stay around once allocated, like the block
+		 * buffers */
+		if (pipelined) {
+			allocate_pipeline_buffers();
+			start_stages(this->slots_count);
+		}
+
+		this->pipelined = pipelined;
+		block_size = update_block_size();
+
+		/* an idle thread per slot for every filter adds up */
+		if (!pipelined)
+			stop_stages();
+	}
+
+	apply_block_size(block_size);
+}
+
+/* has to be called with control_lock held, the stages only ever get added
+ * while pipelined */
+void LV2Rack::start_stages(size_t count)
+{
+	for (size_t i = this->pipeline_threads; i < count; ++i) {
+		sem_init(&this->pipeline_stages[i].wakeup, 0, 0);
+		this->pipeline_stages[i].thread = thread(&LV2Rack::run_stage, this, i);
+	}
+
+	this->pipeline_threads = max(this->pipeline_threads, count);
+	this->pipeline_ready.store(this->pipeline_threads, memory_order_release);
+}
+
+/* has to be called with control_lock held, or from the destructor, and with
+ * pipelined cleared */
+void LV2Rack::stop_stages(void)
+{
+	if (this->pipeline_threads == 0)
+		return;
+
+	/* the audio thread may have seen pipelined just before it was cleared,
+	 * both sides are sequentially consistent, see process_frames() */
+	while (this->dsp_in_block || this->pipeline_pending != 0)
+		this_thread::sleep_for(chrono::milliseconds(1));
+
+	this->pipeline_stopping = true;
+
+	for (size_t i = 0; i < this->pipeline_threads; ++i) {
+		auto &stage = this->pipeline_stages[i];
+
+		sem_post(&stage.wakeup);
+		stage.thread.join();
+		sem_destroy(&stage.wakeup);
+	}
+
+	this->pipeline_threads = 0;
+	this->pipeline_ready.store(0, memory_order_release);
+	this->pipeline_stopping = false;
+}
+
+void LV2Rack::set_offloaded(bool offloaded)
+{
+	size_t block_size;
+
+	{
+		lock_guard<mutex> guard(this->control_lock);
+
+		if (offloaded && !this->offload_buffers_allocated) {
+			for (auto &buffer: this->offload_buffers) {
+				for (size_t ch = 0; ch < MAX_CHANNELS; ++ch)
+					buffer[ch] = (float*) calloc(MAX_AUDIO_FRAMES, sizeof(float));
+			}
+
+			this->offload_buffers_allocated = true;
+		}
+
+		this->offloaded.store(offloaded, memory_order_release);
+		block_size = update_block_size();
+	}
+
+	apply_block_size(block_size);
+}
+
+/* has to be called with control_lock held */
+void LV2Rack::allocate_pipeline_buffers(void)
+{
+	if (this->pipeline_buffers_allocated)
+		return;
+
+	for (auto &buffer: this->pipeline_buffers) {
+		for (size_t ch = 0; ch < MAX_CHANNELS; ++ch)
+			buffer[ch] = (float*) calloc(MAX_AUDIO_FRAMES, sizeof(float));
+	}
+
+	this->pipeline_buffers_allocated = true;
+}
+
+size_t LV2Rack::get_latency(void)
+{
+	size_t block_size = this->block_size;
+
+	if (this->pipelined)
+		return block_size * (1 + get_slots_count());
+
+	if (this->offloaded)
+		return block_size * 2;
+
+	return block_size;
+}
+
+/* has to be called with control_lock held, returns what apply_block_size()
+ * has to be called with once it's released */
+size_t LV2Rack::update_block_size(void)
+{
+	size_t frames = this->wanted_block_size;
+
+	/* the stages hand over whole blocks */
+	if (frames == 0 && (this->pipelined || this->offloaded))
+		frames = NOMINAL_AUDIO_FRAMES;
+
+	/* the audio thread swaps them around, so they are allocated once and
+	 * stay until we are destroyed */
+	if (frames != 0 && !this->block_buffers_allocated) {
+		for (size_t ch = 0; ch < MAX_CHANNELS; ++ch) {
+			this->block_in[ch] = (float*) calloc(MAX_AUDIO_FRAMES, sizeof(float));
+			this->block_out[ch] = (float*) calloc(MAX_AUDIO_FRAMES, sizeof(float));
+		}
+
+		this->block_buffers_allocated = true;
+	}
+
+	return frames;
+}
+
+/* Without control_lock, a slot may hold its own for as long as instantiating
+ * a plugin takes and our lock is taken from OBS's graphics thread too. */
+void LV2Rack::apply_block_size(size_t frames)
+{
+	LV2Plugin *slots[MAX_RACK_SLOTS];
+	size_t count = snapshot_slots(slots);
+
+	for (size_t i = 0; i < count; ++i)
+		slots[i]->set_block_size(frames);
+
+	this->block_size.store(frames, memory_order_release);
+}
+
+/* the slots that exist, they stay until we are destroyed */
+size_t LV2Rack::snapshot_slots(LV2Plugin **slots)
+{
+	lock_guard<mutex> guard(this->control_lock);
+	size_t count = 0;
+
+	for (size_t i = 0; i < MAX_RACK_SLOTS; ++i) {
+		if (this->slots[i] != nullptr)
+			slots[count++] = this->slots[i];
+	}
+
+	return count;
+}
+
+void LV2Rack::suspend(bool free_instance)
+{
+	{
+		lock_guard<mutex> guard(this->control_lock);
+
+		this->suspended = true;
+		this->free_when_suspended = free_instance;
+	}
+
+	LV2Plugin *slots[MAX_RACK_SLOTS];
+	size_t count = snapshot_slots(slots);
+
+	for (size_t i = 0; i < count; ++i)
+		slots[i]->suspend(free_instance);
+}
+
+void LV2Rack::resume(void)
+{
+	{
+		lock_guard<mutex> guard(this->control_lock);
+
+		this->suspended = false;
+	}
+
+	LV2Plugin *slots[MAX_RACK_SLOTS];
+	size_t count = snapshot_slots(slots);
+
+	for (size_t i = 0; i < count; ++i)
+		slots[i]->resume();
+}
+
+bool LV2Rack::is_suspended(void)
+{
+	return this->suspended;
+}
+
+void LV2Rack::process_slots(float **buf, int frames)
+{
+	size_t count = this->slots_count.load(memory_order_acquire);
+
+	for (size_t i = 0; i < count; ++i)
+		this->slots[i].load(memory_order_acquire)->process_frames(buf, frames);
+}
+
+void LV2Rack::process_frames(float **buf, int frames)
+{
+	size_t block_size = this->block_size.load(memory_order_acquire);
+
+	/* start over with silence, that's the latency we have added */
+	if (block_size != this->dsp_block_size) {
+		this->dsp_block_size = block_size;
+		this->block_fill = 0;
+
+		for (size_t ch = 0; ch < MAX_CHANNELS && block_size != 0; ++ch)
+			memset(this->block_out[ch], 0, block_size * sizeof(float));
+	}
+
+	if (block_size == 0) {
+		process_slots(buf, frames);
+		return;
+	}
+
+	/* OBS's frames go in and what was processed one block ago comes out */
+	for (int off = 0; off < frames;) {
+		size_t n = min((size_t) (frames - off), block_size - this->block_fill);
+
+		for (size_t ch = 0; ch < MAX_CHANNELS; ++ch) {
+			if (buf[ch] == nullptr)
+				continue;
+
+			memcpy(this->block_in[ch] + this->block_fill, buf[ch] + off, n * sizeof(float));
+			memcpy(buf[ch] + off, this->block_out[ch] + this->block_fill, n * sizeof(float));
+		}
+
+		this->block_fill += n;
+		off += n;
+
+		if (this->block_fill == block_size) {
+			/* set before pipelined is looked at, so stop_stages()
+			 * can't miss us */
+			this->dsp_in_block = true;
+
+			if (this->pipelined) {
+				process_pipelined(block_size);
+			} else if (this->offloaded.load(memory_order_acquire)) {
+				process_offloaded(block_size);
+			} else {
+				process_slots(this->block_in, block_size);
+				swap(this->block_in, this->block_out);
+			}
+
+			this->dsp_in_block.store(false, memory_order_release);
+			this->block_fill = 0;
+		}
+	}
+}
+
+/* Each tick the new block moves in, every stage takes the block the one
+ * before it has finished during the previous tick, and the block that has
+ * been through all of them moves out. The stages get kicked and we are gone,
+ * if one of them is not done by the next tick that block is dropped - we
+ * never wait for them.
+ *
+ * A stage never runs at the same time as the same slot outside of the
+ * pipeline, LV2Plugin::process_frames() only try-locks. */
+void LV2Rack::process_pipelined(size_t block_size)
+{
+	size_t stages = min(this->slots_count.load(memory_order_acquire),
+			    this->pipeline_ready.load(memory_order_acquire));
+
+	if (this->pipeline_pending.load(memory_order_acquire) != 0) {
+		for (size_t ch = 0; ch < MAX_CHANNELS; ++ch)
+			memset(this->block_out[ch], 0, block_size * sizeof(float));
+
+		return;
+	}
+
+	/* the chain has changed, start over */
+	if (stages != this->dsp_stages || block_size != this->pipeline_block) {
+		for (auto &buffer: this->pipeline_buffers) {
+			for (size_t ch = 0; ch < MAX_CHANNELS; ++ch)
+				memset(buffer[ch], 0, block_size * sizeof(float));
+		}
+
+		this->dsp_stages = stages;
+		this->pipeline_block = block_size;
+		this->dsp_tick = 0;
+	}
+
+	size_t n = stages + 1;
+	auto in = this->pipeline_buffers[this->dsp_tick % n];
+	auto out = this->pipeline_buffers[(this->dsp_tick + 1) % n];
+
+	for (size_t ch = 0; ch < MAX_CHANNELS; ++ch) {
+		memcpy(in[ch], this->block_in[ch], block_size * sizeof(float));
+		memcpy(this->block_out[ch], out[ch], block_size * sizeof(float));
+	}
+
+	this->pipeline_pending.store(stages, memory_order_relaxed);
+
+	for (size_t i = 0; i < stages; ++i) {
+		auto &stage = this->pipeline_stages[i];
+		auto buffer = this->pipeline_buffers[(this->dsp_tick + n - i) % n];
+
+		for (size_t ch = 0; ch < MAX_CHANNELS; ++ch)
+			stage.buf[ch] = buffer[ch];
+
+		sem_post(&stage.wakeup);
+	}
+
+	this->dsp_tick++;
+}
+
+void LV2Rack::run_stage(size_t idx)
+{
+	auto &stage = this->pipeline_stages[idx];
+
+	for (;;) {
+		sem_wait(&stage.wakeup);
+
+		if (this->pipeline_stopping)
+			return;
+
+		auto slot = this->slots[idx].load(memory_order_acquire);
+		slot->process_frames(stage.buf, this->pipeline_block);
+
+		this->pipeline_pending.fetch_sub(1, memory_order_release);
+	}
+}
+
+void LV2Rack::set_ui_update_rate(float rate)
+{
+	lock_guard<mutex> guard(this->control_lock);
+
+	this->ui_update_rate = rate;
+
+	for (size_t i = 0; i < MAX_RACK_SLOTS; ++i) {
+		if (this->slots[i] != nullptr)
+			this->slots[i].load()->set_ui_update_rate(rate);
+	}
+}
+
+/* Like the pipeline with a single stage that runs the whole chain, but on the
+ * shared DSP threads - many filters with a moderate chain each spread over
+ * the cores, where the pipeline is for a single heavy chain. The block is
+ * dropped if the previous one is still not done. */
+void LV2Rack::process_offloaded(size_t block_size)
+{
+	if (this->offload_busy.load(memory_order_acquire)) {
+		for (size_t ch = 0; ch < MAX_CHANNELS; ++ch)
+			memset(this->block_out[ch], 0, block_size * sizeof(float));
+
+		return;
+	}
+
+	auto in = this->offload_buffers[this->offload_tick % 2];
+	auto out = this->offload_buffers[(this->offload_tick + 1) % 2];
+
+	/* the previous block size's leftovers, no need to clear them as they
+	 * would be just one odd block */
+	for (size_t ch = 0; ch < MAX_CHANNELS; ++ch) {
+		memcpy(in[ch], this->block_in[ch], block_size * sizeof(float));
+		memcpy(this->block_out[ch], out[ch], block_size * sizeof(float));
+		this->offload_buf[ch] = in[ch];
+	}
+
+	this->offload_block = block_size;
+	this->offload_tick++;
+	this->offload_busy.store(true, memory_order_relaxed);
+
+	/* the queue is shared and may be full, then it's done right here */
+	if (!this->lv2_world->get_dsp_pool()->submit(LV2Rack::run_offloaded, this))
+		run_offloaded(this);
+}
+
+void LV2Rack::run_offloaded(void *data)
+{
+	LV2Rack *rack = (LV2Rack*) data;
+
+	rack->process_slots(rack->offload_buf, rack->offload_block);
+	rack->offload_busy.store(false, memory_order_release);
+}
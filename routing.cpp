@@ -0,0 +1,267 @@
+/******************************************************************************
+ *   Copyright (C) 2020 by Arkadiusz Hiler
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+#include "obs-lv2.hpp"
+
+/* The mixing kernels. The number of sources is known at compile time for the
+ * common layouts (mono, stereo, 5.1, 7.1), so the inner loop unrolls and the
+ * compiler vectorizes the outer one over the frames. */
+template <size_t N>
+static void mix_fixed(float *__restrict dst, float *const *src, const float *gains, int frames)
+{
+	const float *s[N];
+	float g[N];
+
+	for (size_t i = 0; i < N; ++i) {
+		s[i] = src[i];
+		g[i] = gains[i];
+	}
+
+	for (int i = 0; i < frames; ++i) {
+		float acc = 0.0f;
+
+		for (size_t j = 0; j < N; ++j)
+			acc += g[j] * s[j][i];
+
+		dst[i] = acc;
+	}
+}
+
+static void mix_any(float *__restrict dst, float *const *src, const float *gains,
+		    size_t n, int frames)
+{
+	memset(dst, 0, frames * sizeof(*dst));
+
+	for (size_t j = 0; j < n; ++j) {
+		const float *s = src[j];
+		float g = gains[j];
+
+		if (g == 0.0f)
+			continue;
+
+		for (int i = 0; i < frames; ++i)
+			dst[i] += g * s[i];
+	}
+}
+
+static void mix(float *dst, float *const *src, const float *gains, size_t n, int frames)
+{
+	switch (n) {
+	case 1:
+		mix_fixed<1>(dst, src, gains, frames);
+		break;
+	case 2:
+		mix_fixed<2>(dst, src, gains, frames);
+		break;
+	case 6:
+		mix_fixed<6>(dst, src, gains, frames);
+		break;
+	case 8:
+		mix_fixed<8>(dst, src, gains, frames);
+		break;
+	default:
+		mix_any(dst, src, gains, n, frames);
+		break;
+	}
+}
+
+/* missing gains are 0, extra ones are ignored */
+static void parse_matrix(const std::string &text, float *gains, size_t rows, size_t cols)
+{
+	size_t row = 0;
+	size_t col = 0;
+	const char *p = text.c_str();
+
+	while (*p != '\0' && row < rows) {
+		if (*p == ';' || *p == '\n') {
+			row++;
+			col = 0;
+			p++;
+			continue;
+		}
+
+		if (isspace(*p) || *p == ',') {
+			p++;
+			continue;
+		}
+
+		char *end;
+		float gain = strtof(p, &end);
+
+		if (end == p) {
+			WARN("unexpected '%c' in the routing matrix\n", *p);
+			p++;
+			continue;
+		}
+
+		if (col < cols)
+			gains[row * cols + col] = gain;
+
+		col++;
+		p = end;
+	}
+}
+
+void LV2Plugin::set_routing(RoutingPreset preset, const char *input, const char *output)
+{
+	std::lock_guard<std::mutex> guard(this->control_lock);
+
+	std::string in = input != nullptr ? input : "";
+	std::string out = output != nullptr ? output : "";
+
+	if (this->routing_preset == preset &&
+	    (preset != ROUTING_CUSTOM ||
+	     (this->routing_input == in && this->routing_output == out)))
+		return;
+
+	this->routing_preset = preset;
+	this->routing_input = in;
+	this->routing_output = out;
+
+	/* going from or to the copies needs a different set of instances,
+	 * and the UI must not outlive the ones it's bound to */
+	LV2Instance *inst = this->inst;
+
+	if (inst != nullptr && wants_copies(inst) != (inst->copies_count > 0))
+		invalidate_instance();
+	else
+		this->routing_changed = true;
+}
+
+/* whether create_instance() would give it copies */
+bool LV2Plugin::wants_copies(LV2Instance *inst)
+{
+	size_t per_instance = std::min(inst->input_channels_count,
+				       inst->output_channels_count);
+
+	return this->routing_preset == ROUTING_BY_INDEX &&
+		per_instance != 0 && per_instance < this->channels;
+}
+
+/* the instance must not be running */
+void LV2Plugin::update_routing(LV2Instance *inst)
+{
+	free_routing(inst->routing);
+	inst->routing = nullptr;
+
+	if (this->routing_preset == ROUTING_BY_INDEX)
+		return;
+
+	size_t chs = std::min(inst->channels, (size_t) MAX_CHANNELS);
+	size_t ins = inst->input_channels_count;
+	size_t outs = inst->output_channels_count;
+
+	LV2Routing *routing = new LV2Routing();
+	routing->channels = chs;
+	routing->inputs = ins;
+	routing->outputs = outs;
+	routing->in = (float*) calloc(std::max(ins * chs, (size_t) 1), sizeof(float));
+	routing->out = (float*) calloc(std::max(chs * outs, (size_t) 1), sizeof(float));
+
+	switch (this->routing_preset) {
+	case ROUTING_DOWNMIX:
+		/* channel c goes to port c % ins, averaged, output port
+		 * c % outs goes back to it */
+		for (size_t p = 0; p < ins; ++p) {
+			size_t n = 0;
+
+			for (size_t c = p; c < chs; c += ins)
+				n++;
+
+			for (size_t c = p; c < chs; c += ins)
+				routing->in[p * chs + c] = 1.0f / n;
+		}
+
+		for (size_t c = 0; c < chs && outs > 0; ++c)
+			routing->out[c * outs + c % outs] = 1.0f;
+		break;
+	case ROUTING_UPMIX:
+		/* the other way around */
+		for (size_t p = 0; p < ins && chs > 0; ++p)
+			routing->in[p * chs + p % chs] = 1.0f;
+
+		for (size_t c = 0; c < chs; ++c) {
+			size_t n = 0;
+
+			for (size_t o = c; o < outs; o += chs)
+				n++;
+
+			for (size_t o = c; o < outs; o += chs)
+				routing->out[c * outs + o] = 1.0f / n;
+		}
+		break;
+	default:
+		parse_matrix(this->routing_input, routing->in, ins, chs);
+		parse_matrix(this->routing_output, routing->out, chs, outs);
+		break;
+	}
+
+	for (size_t c = 0; c < MAX_CHANNELS; ++c) {
+		routing->dry[c] = true;
+
+		for (size_t o = 0; c < chs && o < outs; ++o) {
+			if (routing->out[c * outs + o] != 0.0f)
+				routing->dry[c] = false;
+		}
+
+		routing->mixed[c] = (float*) calloc(MAX_AUDIO_FRAMES, sizeof(float));
+	}
+
+	inst->routing = routing;
+}
+
+void LV2Plugin::free_routing(LV2Routing *routing)
+{
+	if (routing == nullptr)
+		return;
+
+	for (size_t c = 0; c < MAX_CHANNELS; ++c)
+		free(routing->mixed[c]);
+
+	free(routing->in);
+	free(routing->out);
+
+	delete routing;
+}
+
+/* mixes straight into the plug-in's buffers and out of them, so it's a
+ * single pass each way like the plain copying */
+void LV2Plugin::run_routed(LV2Instance *inst, float **buf, int frames, float **out)
+{
+	LV2Routing *routing = inst->routing;
+
+	connect_audio(inst, nullptr);
+
+	for (size_t p = 0; p < routing->inputs; ++p)
+		mix(inst->input_buffer[p], buf, routing->in + p * routing->channels,
+		    routing->channels, frames);
+
+	prepare_atom_ports(inst);
+	lilv_instance_run(inst->instance, frames);
+	deliver_worker_responses(inst);
+
+	for (size_t c = 0; c < routing->channels; ++c) {
+		if (routing->dry[c]) {
+			if (out[c] != buf[c])
+				memcpy(out[c], buf[c], frames * sizeof(float));
+			continue;
+		}
+
+		mix(out[c], inst->output_buffer, routing->out + c * routing->outputs,
+		    routing->outputs, frames);
+	}
+}
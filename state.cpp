@@ -26,11 +26,15 @@ const void *LV2Plugin::get_port_value(const char *port_symbol,
 {
 	LV2Plugin *lv2 = (LV2Plugin*)user_data;
 
-	auto idx = LV2Plugin::suil_port_index(lv2, port_symbol);
+	auto idx = lv2->port_index(port_symbol);
+
+	if (idx == LV2UI_INVALID_PORT_INDEX)
+		return nullptr;
+
 	*size = sizeof(float);
 	*type = PROTOCOL_FLOAT;
 
-	return &lv2->ports[idx].value;
+	return &lv2->inst.load()->ports[idx].value;
 }
 
 void LV2Plugin::set_port_value(const char *port_symbol,
@@ -54,22 +58,48 @@ void LV2Plugin::set_port_value(const char *port_symbol,
 		return;
 	}
 
-	lv2->ports[idx].value = *((float*) value);
+	LV2Instance *inst = lv2->inst;
+
+	/* restoring happens only while the audio thread doesn't have the
+	 * instance, see reconcile(), so it's fine to write what it reads */
+	inst->ports[idx].value = *((float*) value);
+	inst->controls[idx] = *((float*) value);
+
+	/* the copies follow the first instance */
+	for (size_t i = 0; i < inst->copies_count; ++i) {
+		inst->copies[i]->ports[idx].value = *((float*) value);
+		inst->copies[i]->controls[idx] = *((float*) value);
+	}
 }
 
 char *LV2Plugin::get_state(void)
 {
-	if (this->plugin_instance == nullptr)
+	std::lock_guard<std::mutex> guard(this->control_lock);
+
+	/* not restored yet, hand back what we were given */
+	if (this->has_pending_state)
+		return strdup(this->pending_state.c_str());
+
+	return serialize_state();
+}
+
+char *LV2Plugin::serialize_state(void)
+{
+	LV2Instance *inst = this->inst;
+
+	if (inst == nullptr)
 		return NULL;
 
-	auto state = lilv_state_new_from_instance(this->plugin,
-			this->plugin_instance,
+	auto world_guard = lv2_world->lock_world();
+
+	auto state = lilv_state_new_from_instance(inst->plugin,
+			inst->instance,
 			&this->feature_uri_map_data,
 			NULL, NULL, NULL, NULL,
 			LV2Plugin::get_port_value,
 			this,
 			LV2_STATE_IS_POD,
-			this->features);
+			inst->features);
 
 	auto str = lilv_state_to_string(this->world,
 			&this->feature_uri_map_data,
@@ -85,19 +115,42 @@ char *LV2Plugin::get_state(void)
 
 void LV2Plugin::set_state(const char *str)
 {
-	if (str == nullptr || this->plugin_instance == nullptr)
+	LV2Instance *inst = this->inst;
+
+	if (str == nullptr || inst == nullptr)
 		return;
 
+	auto world_guard = lv2_world->lock_world();
+
 	auto state = lilv_state_new_from_string(this->world,
 			&this->feature_uri_map_data,
 			str);
 
+	if (state == nullptr)
+		return;
+
+	/* restoring may take a while, and only the parsing and freeing
+	 * touch the world. The instance's own features, so work:schedule is
+	 * there for plugins that load things in the background. */
+	world_guard.unlock();
+
 	lilv_state_restore(state,
-			   this->plugin_instance,
+			   inst->instance,
 			   LV2Plugin::set_port_value,
 			   this,
 			   LV2_STATE_IS_POD,
-			   this->features);
+			   inst->features);
+
+	/* the port values are already there, set_port_value() does them */
+	for (size_t i = 0; i < inst->copies_count; ++i) {
+		lilv_state_restore(state,
+				   inst->copies[i]->instance,
+				   nullptr,
+				   nullptr,
+				   LV2_STATE_IS_POD,
+				   inst->copies[i]->features);
+	}
 
+	world_guard.lock();
 	lilv_state_free(state);
 }
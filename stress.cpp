@@ -0,0 +1,650 @@
+/******************************************************************************
+ *   Copyright (C) 2020 by Arkadiusz Hiler
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+/* Drives the filter's callbacks the way OBS does, from an audio, a video and
+ * a UI thread at once, against a stand-in for the bits of libobs they use.
+ * The UI thread keeps switching plug-ins, sample rates and settings and
+ * saves while the audio flows, and filters get destroyed and recreated from
+ * what was saved. Configure with -Db_sanitize=thread to get the races
+ * reported. How long the audio thread got held up is printed at the end.
+ *
+ *   obs-lv2-stress [-d 30] [-l 5] [-n 2] [-m 0] [-r] [uri...]
+ *
+ * -m is in OBS's audio periods, AUDIO_OUTPUT_FRAMES at the current sample
+ * rate, as that's how long OBS gives all its filters for a tick.
+ */
+
+#include <obs/obs-module.h>
+#include <obs/util/platform.h>
+#include "obs-lv2.hpp"
+#include <QCoreApplication>
+#include <random>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* LIBOBS STAND-IN - just enough for obs-lv2.cpp, not thread safe where
+ * libobs isn't either */
+struct obs_data
+{
+	std::map<std::string, std::string> values;
+	std::map<std::string, std::string> defaults;
+};
+
+struct obs_property
+{
+	std::string name;
+	bool visible = true;
+};
+
+struct obs_properties
+{
+	std::deque<obs_property> properties;
+};
+
+struct obs_source
+{
+	std::string name;
+	obs_source *parent = nullptr;
+	std::atomic<bool> active { false };
+};
+
+struct audio_output
+{
+	std::atomic<uint32_t> sample_rate { 48000 };
+	std::atomic<size_t> channels { 2 };
+};
+
+static audio_output audio;
+static const struct obs_source_info *filter_info = nullptr;
+static std::string config_dir;
+
+void blog(int log_level, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+
+	fputc('\n', stderr);
+}
+
+void bfree(void *ptr)
+{
+	free(ptr);
+}
+
+int os_mkdirs(const char *path)
+{
+	return mkdir(path, 0755) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+char *obs_module_get_config_path(obs_module_t *module, const char *file)
+{
+	UNUSED_PARAMETER(module);
+	return strdup((config_dir + "/" + file).c_str());
+}
+
+void obs_register_source_s(const struct obs_source_info *info, size_t size)
+{
+	UNUSED_PARAMETER(size);
+	filter_info = info;
+}
+
+audio_t *obs_get_audio(void)
+{
+	return &audio;
+}
+
+size_t audio_output_get_channels(const audio_t *audio)
+{
+	return audio->channels;
+}
+
+uint32_t audio_output_get_sample_rate(const audio_t *audio)
+{
+	return audio->sample_rate;
+}
+
+obs_data_t *obs_data_create()
+{
+	return new obs_data();
+}
+
+void obs_data_release(obs_data_t *data)
+{
+	delete data;
+}
+
+static const std::string *find_value(obs_data_t *data, const char *name)
+{
+	auto value = data->values.find(name);
+	if (value != data->values.end())
+		return &value->second;
+
+	auto def = data->defaults.find(name);
+	if (def != data->defaults.end())
+		return &def->second;
+
+	return nullptr;
+}
+
+const char *obs_data_get_string(obs_data_t *data, const char *name)
+{
+	auto value = find_value(data, name);
+	return value != nullptr ? value->c_str() : "";
+}
+
+long long obs_data_get_int(obs_data_t *data, const char *name)
+{
+	auto value = find_value(data, name);
+	return value != nullptr ? strtoll(value->c_str(), nullptr, 10) : 0;
+}
+
+bool obs_data_get_bool(obs_data_t *data, const char *name)
+{
+	return obs_data_get_int(data, name) != 0;
+}
+
+void obs_data_set_string(obs_data_t *data, const char *name, const char *val)
+{
+	data->values[name] = val;
+}
+
+void obs_data_set_int(obs_data_t *data, const char *name, long long val)
+{
+	data->values[name] = std::to_string(val);
+}
+
+void obs_data_set_bool(obs_data_t *data, const char *name, bool val)
+{
+	obs_data_set_int(data, name, val);
+}
+
+void obs_data_set_default_int(obs_data_t *data, const char *name, long long val)
+{
+	data->defaults[name] = std::to_string(val);
+}
+
+void obs_data_erase(obs_data_t *data, const char *name)
+{
+	data->values.erase(name);
+}
+
+obs_properties_t *obs_properties_create(void)
+{
+	return new obs_properties();
+}
+
+void obs_properties_destroy(obs_properties_t *props)
+{
+	delete props;
+}
+
+static obs_property_t *add_property(obs_properties_t *props, const char *name)
+{
+	props->properties.emplace_back();
+	props->properties.back().name = name;
+
+	return &props->properties.back();
+}
+
+obs_property_t *obs_properties_add_list(obs_properties_t *props, const char *name,
+					const char *description, enum obs_combo_type type,
+					enum obs_combo_format format)
+{
+	return add_property(props, name);
+}
+
+obs_property_t *obs_properties_add_button(obs_properties_t *props, const char *name,
+					  const char *text, obs_property_clicked_t callback)
+{
+	return add_property(props, name);
+}
+
+obs_property_t *obs_properties_add_bool(obs_properties_t *props, const char *name,
+					const char *description)
+{
+	return add_property(props, name);
+}
+
+obs_property_t *obs_properties_add_int(obs_properties_t *props, const char *name,
+				       const char *description, int min, int max, int step)
+{
+	return add_property(props, name);
+}
+
+obs_property_t *obs_properties_add_text(obs_properties_t *props, const char *name,
+					const char *description, enum obs_text_type type)
+{
+	return add_property(props, name);
+}
+
+obs_property_t *obs_properties_get(obs_properties_t *props, const char *property)
+{
+	for (auto &p: props->properties) {
+		if (p.name == property)
+			return &p;
+	}
+
+	return nullptr;
+}
+
+const char *obs_property_name(obs_property_t *p)
+{
+	return p->name.c_str();
+}
+
+void obs_property_set_visible(obs_property_t *p, bool visible)
+{
+	if (p != nullptr)
+		p->visible = visible;
+}
+
+void obs_property_set_long_description(obs_property_t *p, const char *long_description)
+{
+}
+
+void obs_property_set_modified_callback(obs_property_t *p, obs_property_modified_t modified)
+{
+}
+
+size_t obs_property_list_add_string(obs_property_t *p, const char *name, const char *val)
+{
+	return 0;
+}
+
+size_t obs_property_list_add_int(obs_property_t *p, const char *name, long long val)
+{
+	return 0;
+}
+
+void obs_property_list_item_disable(obs_property_t *p, size_t idx, bool disabled)
+{
+}
+
+const char *obs_source_get_name(const obs_source_t *source)
+{
+	return source->name.c_str();
+}
+
+void obs_source_update_properties(obs_source_t *source)
+{
+}
+
+obs_source_t *obs_filter_get_parent(const obs_source_t *filter)
+{
+	return filter->parent;
+}
+
+bool obs_source_active(const obs_source_t *source)
+{
+	return source->active;
+}
+
+bool obs_source_showing(const obs_source_t *source)
+{
+	return source->active;
+}
+
+/* THE STRESS TEST */
+
+/* the settings keys, as in obs-lv2.cpp */
+#define PROP_PLUGIN_LIST "lv2_plugin_list"
+#define PROP_IDLE_POLICY "lv2_idle_policy"
+#define PROP_IDLE_TIMEOUT "lv2_idle_timeout"
+#define PROP_BLOCK_SIZE "lv2_block_size"
+#define PROP_RACK_SLOTS "lv2_rack_slots"
+#define PROP_PIPELINED "lv2_pipelined"
+#define PROP_OFFLOADED "lv2_offloaded"
+#define PROP_BYPASS "lv2_bypass"
+#define PROP_ROUTING "lv2_routing"
+
+/* more slots than that only makes the chain longer */
+#define STRESS_SLOTS 3
+
+struct StressConfig
+{
+	double duration = 30.0;
+	double lifetime = 5.0;
+	size_t filters = 2;
+	double max_stall_periods = 0.0;
+	bool realtime = false;
+	std::vector<std::string> uris;
+};
+
+struct Filter
+{
+	obs_source_t parent;
+	obs_source_t source;
+	obs_data_t *settings;
+	void *data;
+};
+
+static std::atomic<bool> stopping { false };
+static DspLoad stalls;
+
+/* the longest filter_audio() in OBS's audio periods, audio thread only */
+static double worst_stall = 0.0;
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options] [plugin uri...]\n"
+		"  -d seconds to run for, default 30\n"
+		"  -l seconds each set of filters lives, default 5\n"
+		"  -n count   filters on the source, default 2\n"
+		"  -m periods fail if the audio thread is ever held up for longer than this many\n"
+		"             of OBS's audio periods, default 0 (never)\n"
+		"  -r         feed the audio in real time instead of as fast as possible\n"
+		"the plug-ins to switch between default to the eg-amp example\n",
+		name);
+}
+
+static bool parse_args(int argc, char **argv, StressConfig &config)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:l:n:m:rh")) != -1) {
+		switch (opt) {
+		case 'd':
+			config.duration = atof(optarg);
+			break;
+		case 'l':
+			config.lifetime = atof(optarg);
+			break;
+		case 'n':
+			config.filters = strtoul(optarg, nullptr, 10);
+			break;
+		case 'm':
+			config.max_stall_periods = atof(optarg);
+			break;
+		case 'r':
+			config.realtime = true;
+			break;
+		default:
+			return false;
+		}
+	}
+
+	for (int i = optind; i < argc; ++i)
+		config.uris.push_back(argv[i]);
+
+	if (config.uris.empty())
+		config.uris.push_back("http://lv2plug.in/plugins/eg-amp");
+
+	/* and no plug-in at all */
+	config.uris.push_back("");
+
+	return config.duration > 0.0 && config.lifetime > 0.0 && config.filters > 0;
+}
+
+static std::string slot_key(const char *base, size_t idx)
+{
+	if (idx == 0)
+		return base;
+
+	return std::string(base) + "_" + std::to_string(idx + 1);
+}
+
+/* OBS's audio thread, the frame counts vary as they do with async sources */
+static void audio_thread(std::vector<Filter*> *filters, size_t channels, bool realtime)
+{
+	const uint32_t frame_counts[] = { AUDIO_OUTPUT_FRAMES, AUDIO_OUTPUT_FRAMES, 480, 1, 1023 };
+	std::vector<float> buffers(MAX_CHANNELS * AUDIO_OUTPUT_FRAMES);
+	std::minstd_rand rng(1);
+	auto next = std::chrono::steady_clock::now();
+
+	while (!stopping) {
+		uint32_t frames = frame_counts[rng() % (sizeof(frame_counts) / sizeof(*frame_counts))];
+		uint32_t sample_rate = audio.sample_rate;
+
+		for (Filter *f: *filters) {
+			struct obs_audio_data data = {};
+
+			for (size_t ch = 0; ch < channels; ++ch) {
+				float *buf = buffers.data() + ch * AUDIO_OUTPUT_FRAMES;
+
+				for (uint32_t i = 0; i < frames; ++i)
+					buf[i] = (float) (rng() % 2001) / 1000.0f - 1.0f;
+
+				data.data[ch] = (uint8_t *) buf;
+			}
+
+			data.frames = frames;
+
+			auto start = std::chrono::steady_clock::now();
+			filter_info->filter_audio(f->data, &data);
+			auto end = std::chrono::steady_clock::now();
+
+			uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+			stalls.add(ns, (uint64_t) frames * 1000000000 / sample_rate);
+
+			double period_ns = (double) AUDIO_OUTPUT_FRAMES * 1e9 / sample_rate;
+			worst_stall = std::max(worst_stall, ns / period_ns);
+		}
+
+		if (realtime) {
+			next += std::chrono::nanoseconds((uint64_t) frames * 1000000000 / sample_rate);
+			std::this_thread::sleep_until(next);
+		}
+	}
+}
+
+/* OBS's graphics thread ticks the filters, the source goes in and out of
+ * use now and then so the idle policy kicks in */
+static void video_thread(std::vector<Filter*> *filters)
+{
+	std::minstd_rand rng(2);
+
+	while (!stopping) {
+		for (Filter *f: *filters) {
+			if (rng() % 64 == 0) {
+				f->parent.active = !f->parent.active;
+
+				if (f->parent.active)
+					filter_info->activate(f->data);
+				else
+					filter_info->deactivate(f->data);
+			}
+
+			filter_info->video_tick(f->data, 1.0f / 60.0f);
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(16));
+	}
+}
+
+/* what a user clicking around the properties would do, only much faster */
+static void poke(Filter *f, const StressConfig &config, std::minstd_rand &rng)
+{
+	obs_data_t *settings = f->settings;
+	size_t slot = rng() % STRESS_SLOTS;
+
+	switch (rng() % 10) {
+	case 0:
+	case 1:
+	case 2:
+		obs_data_set_string(settings, slot_key(PROP_PLUGIN_LIST, slot).c_str(),
+				    config.uris[rng() % config.uris.size()].c_str());
+		break;
+	case 3:
+		obs_data_set_int(settings, PROP_RACK_SLOTS, 1 + rng() % STRESS_SLOTS);
+		break;
+	case 4: {
+		const int sizes[] = { 0, 256, 512, 1024, 4096 };
+		obs_data_set_int(settings, PROP_BLOCK_SIZE, sizes[rng() % 5]);
+		break;
+	}
+	case 5:
+		obs_data_set_bool(settings, PROP_PIPELINED, rng() % 2);
+		obs_data_set_bool(settings, PROP_OFFLOADED, rng() % 2);
+		break;
+	case 6:
+		obs_data_set_bool(settings, slot_key(PROP_BYPASS, slot).c_str(), rng() % 2);
+		obs_data_set_int(settings, slot_key(PROP_ROUTING, slot).c_str(), rng() % ROUTING_CUSTOM);
+		break;
+	case 7:
+		obs_data_set_int(settings, PROP_IDLE_POLICY, rng() % 3);
+		obs_data_set_int(settings, PROP_IDLE_TIMEOUT, rng() % 2);
+		break;
+	case 8: {
+		/* needs a restart of the audio in OBS, the filters only see an
+		 * update, which is the interesting part */
+		const uint32_t rates[] = { 44100, 48000, 96000 };
+		audio.sample_rate = rates[rng() % 3];
+		break;
+	}
+	case 9: {
+		obs_properties_t *props = filter_info->get_properties(f->data);
+		obs_properties_destroy(props);
+
+		filter_info->save(f->data, settings);
+		return;
+	}
+	}
+
+	filter_info->update(f->data, settings);
+}
+
+static Filter *create_filter(size_t idx, obs_data_t *saved)
+{
+	Filter *f = new Filter();
+
+	f->parent.name = "source";
+	f->parent.active = true;
+	f->source.name = "filter " + std::to_string(idx + 1);
+	f->source.parent = &f->parent;
+
+	f->settings = obs_data_create();
+	filter_info->get_defaults(f->settings);
+
+	if (saved != nullptr)
+		f->settings->values = saved->values;
+
+	f->data = filter_info->create(f->settings, &f->source);
+
+	return f;
+}
+
+static void destroy_filter(Filter *f, obs_data_t *saved)
+{
+	/* what goes into the scene collection on exit */
+	filter_info->save(f->data, f->settings);
+	saved->values = f->settings->values;
+
+	filter_info->destroy(f->data);
+	obs_data_release(f->settings);
+	delete f;
+}
+
+int main(int argc, char **argv)
+{
+	StressConfig config;
+
+	if (!parse_args(argc, argv, config)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* the shared GUI timer is a QObject, which wants the Qt main thread */
+	QCoreApplication app(argc, argv);
+
+	char dir[] = "/tmp/obs-lv2-stress-XXXXXX";
+	if (mkdtemp(dir) == nullptr) {
+		perror("mkdtemp");
+		return 1;
+	}
+	config_dir = dir;
+
+	obs_module_load();
+
+	std::vector<obs_data_t*> saved;
+	for (size_t i = 0; i < config.filters; ++i)
+		saved.push_back(obs_data_create());
+
+	const size_t channel_counts[] = { 2, 1, 6 };
+	std::minstd_rand rng(3);
+	uint64_t pokes = 0;
+	size_t cycles = 0;
+
+	auto end = std::chrono::steady_clock::now() +
+		std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(config.duration));
+
+	while (std::chrono::steady_clock::now() < end) {
+		/* the layout can't change under live filters in OBS either */
+		size_t channels = channel_counts[cycles % 3];
+		audio.channels = channels;
+
+		std::vector<Filter*> filters;
+		for (size_t i = 0; i < config.filters; ++i)
+			filters.push_back(create_filter(i, saved[i]));
+
+		stopping = false;
+		std::thread audio_worker(audio_thread, &filters, channels, config.realtime);
+		std::thread video_worker(video_thread, &filters);
+
+		auto cycle_end = std::min(end, std::chrono::steady_clock::now() +
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(config.lifetime)));
+
+		while (std::chrono::steady_clock::now() < cycle_end) {
+			poke(filters[rng() % filters.size()], config, rng);
+			pokes++;
+
+			std::this_thread::sleep_for(std::chrono::microseconds(rng() % 2000));
+		}
+
+		stopping = true;
+		audio_worker.join();
+		video_worker.join();
+
+		for (size_t i = 0; i < filters.size(); ++i)
+			destroy_filter(filters[i], saved[i]);
+
+		cycles++;
+	}
+
+	for (auto data: saved)
+		obs_data_release(data);
+
+	obs_module_unload();
+
+	unlink((config_dir + "/catalog.cache").c_str());
+	rmdir(config_dir.c_str());
+
+	auto stats = stalls.get();
+
+	printf("%zu filter lifetimes, %llu settings changes, %llu audio blocks\n"
+	       "audio thread held up: %.0f/%.0f/%.0f us min/mean/max per block, "
+	       "%.0f%% of the budget at p99, %llu blocks over budget, "
+	       "%.2f audio periods at worst\n",
+	       cycles, (unsigned long long) pokes,
+	       (unsigned long long) stats.blocks,
+	       stats.min_us, stats.mean_us, stats.max_us,
+	       stats.p99_load,
+	       (unsigned long long) stats.over_budget,
+	       worst_stall);
+
+	if (config.max_stall_periods > 0.0 && worst_stall > config.max_stall_periods) {
+		fprintf(stderr, "the audio thread was held up for %.2f audio periods, more than %.2f\n",
+			worst_stall, config.max_stall_periods);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,75 @@
+/******************************************************************************
+ *   Copyright (C) 2020 by Arkadiusz Hiler
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+#include "obs-lv2.hpp"
+
+using namespace std;
+
+TaskPool::TaskPool(size_t threads)
+{
+	if (threads == 0)
+		threads = 1;
+
+	for (size_t i = 0; i < threads; ++i)
+		this->workers.push_back(thread(&TaskPool::work, this));
+}
+
+TaskPool::~TaskPool()
+{
+	{
+		lock_guard<mutex> guard(this->lock);
+		this->stopping = true;
+	}
+
+	this->cond.notify_all();
+
+	for (auto &worker: this->workers)
+		worker.join();
+}
+
+void TaskPool::submit(function<void(void)> task)
+{
+	{
+		lock_guard<mutex> guard(this->lock);
+		this->queue.push_back(task);
+	}
+
+	this->cond.notify_one();
+}
+
+void TaskPool::work(void)
+{
+	for (;;) {
+		function<void(void)> task;
+
+		{
+			unique_lock<mutex> guard(this->lock);
+			this->cond.wait(guard, [this] {
+				return this->stopping || !this->queue.empty();
+			});
+
+			/* drain whatever is queued before stopping */
+			if (this->queue.empty())
+				return;
+
+			task = this->queue.front();
+			this->queue.pop_front();
+		}
+
+		task();
+	}
+}
@@ -58,6 +58,14 @@ void WidgetWindow::closeEvent(QCloseEvent *event)
 }
 
 /* SUIL CALLBACKS */
+static void write_control(LV2Instance *inst, uint32_t idx, float value)
+{
+	inst->controls[idx] = value;
+
+	for (size_t i = 0; i < inst->copies_count; ++i)
+		inst->copies[i]->controls[idx] = value;
+}
+
 void LV2Plugin::suil_write_from_ui(void *controller,
 				   uint32_t port_index,
 				   uint32_t buffer_size,
@@ -66,12 +74,79 @@ void LV2Plugin::suil_write_from_ui(void *controller,
 {
 	LV2Plugin *lv2 = (LV2Plugin*)controller;
 
+	/* e.g. patch:Set messages for the plugin's atom input */
+	if (port_protocol == lv2->urid_atom_event_transfer) {
+		lv2->write_atom_from_ui(port_index, buffer_size, buffer);
+		return;
+	}
+
 	if (port_protocol != PROTOCOL_FLOAT || buffer_size != sizeof(float)) {
 		printf("gui is trying use protocol %u with buffer_size %u\n", port_protocol, buffer_size);
 		return; /* we MUST gracefully ignore according to the spec */
 	}
 
-	lv2->ports[port_index].value = *((float*)buffer);
+	LV2Instance *inst = lv2->inst.load(std::memory_order_acquire);
+
+	if (inst == nullptr || port_index >= inst->ports_count)
+		return;
+
+	auto port = inst->ports + port_index;
+
+	if (inst->port_table->types[port_index] != PORT_CONTROL ||
+	    !inst->port_table->is_input(port_index))
+		return;
+
+	/* ports[].value is just what we show and save */
+	port->value = *((float*)buffer);
+
+	/* nobody would drain the queue while the audio thread doesn't have
+	 * the instance (bypassed or suspended), it's ours to write then -
+	 * reconcile() publishes under control_lock. What's still queued from
+	 * before goes first, it's older. */
+	{
+		std::lock_guard<std::mutex> guard(lv2->control_lock);
+
+		if (lv2->published.load(std::memory_order_acquire) != inst) {
+			ControlChange change;
+
+			while (inst->control_changes.pop(&change))
+				write_control(inst, change.index, change.value);
+
+			write_control(inst, port_index, port->value);
+			return;
+		}
+	}
+
+	/* the audio thread picks it up with the next block */
+	if (!inst->control_changes.push(port_index, port->value))
+		WARN("control queue full, dropping a change of port %u\n", port_index);
+}
+
+void LV2Plugin::write_atom_from_ui(uint32_t port_index,
+				   uint32_t buffer_size,
+				   const void *buffer)
+{
+	LV2Instance *inst = this->inst.load(std::memory_order_acquire);
+
+	if (inst == nullptr || inst->atom_events == nullptr || port_index >= inst->ports_count)
+		return;
+
+	if (inst->port_table->types[port_index] != PORT_ATOM ||
+	    !inst->port_table->is_input(port_index) || buffer_size < sizeof(LV2_Atom) ||
+	    ((const LV2_Atom*) buffer)->size > buffer_size - sizeof(LV2_Atom))
+		return;
+
+	/* framed the way prepare_atom_ports() expects it, an event at the
+	 * start of the block */
+	std::vector<uint8_t> msg(2 * sizeof(uint32_t) + sizeof(LV2_Atom_Event) - sizeof(LV2_Atom) + buffer_size);
+	LV2_Atom_Event *ev = (LV2_Atom_Event*) (msg.data() + 2 * sizeof(uint32_t));
+
+	*((uint32_t*) msg.data()) = port_index;
+	ev->time.frames = 0;
+	memcpy(&ev->body, buffer, buffer_size);
+
+	if (!inst->atom_events->write(msg.size(), msg.data()))
+		WARN("atom event queue full, dropping an event for port %u\n", port_index);
 }
 
 uint32_t LV2Plugin::suil_port_index(void *controller, const char *symbol)
@@ -84,12 +159,35 @@ uint32_t LV2Plugin::suil_port_index(void *controller, const char *symbol)
 /* UI HANDLING */
 void LV2Plugin::prepare_ui()
 {
-	if (this->plugin_instance == nullptr || this->plugin_uri == nullptr)
+	std::lock_guard<std::mutex> guard(this->control_lock);
+
+	LV2Instance *inst = this->inst;
+
+	/* the UI would be bound to an instance that's about to be replaced */
+	if (inst == nullptr || this->instance_needs_update || this->plugin_uri == nullptr)
 		return;
 
 	if (this->ui_instance != nullptr)
 		return;
 
+	/* ui:updateRate, and we call ui:idleInterface as often */
+	this->ui_options_rate = this->ui_update_rate;
+	this->ui_options[0] = { LV2_OPTIONS_INSTANCE, 0, urid_map(LV2_UI__updateRate),
+				sizeof(float), urid_map(LV2_ATOM__Float), &this->ui_options_rate };
+	this->ui_options[1] = { LV2_OPTIONS_INSTANCE, 0, 0, 0, 0, nullptr };
+	this->ui_feature_options = { LV2_OPTIONS__options, this->ui_options };
+	this->ui_feature_idle = { LV2_UI__idleInterface, nullptr };
+
+	size_t n = 0;
+	for (auto f = this->features; *f != nullptr; ++f) {
+		if (*f == &this->feature_options)
+			this->ui_features[n++] = &this->ui_feature_options;
+		else
+			this->ui_features[n++] = *f;
+	}
+	this->ui_features[n++] = &this->ui_feature_idle;
+	this->ui_features[n] = nullptr;
+
 	char* bundle_path = lilv_file_uri_parse(lilv_node_as_uri(lilv_ui_get_bundle_uri(this->ui)), NULL);
 	char* binary_path = lilv_file_uri_parse(lilv_node_as_uri(lilv_ui_get_binary_uri(this->ui)), NULL);
 
@@ -101,7 +199,7 @@ void LV2Plugin::prepare_ui()
 					      lilv_node_as_uri(this->ui_type),
 					      bundle_path,
 					      binary_path,
-					      this->features);
+					      this->ui_features);
 
 	if (this->ui_instance == nullptr) {
 		printf("failed to find ui!\n");
@@ -119,32 +217,47 @@ void LV2Plugin::prepare_ui()
 
 	ui_window->setWidget(widget);
 
-	for (size_t i = 0; i < this->ports_count; ++i) {
-		auto port = this->ports + i;
+	this->ui_idle = (const LV2UI_Idle_Interface*)
+		suil_instance_extension_data(this->ui_instance, LV2_UI__idleInterface);
+
+	prepare_ui_notifications(inst);
 
-		if (port->type != PORT_CONTROL)
+	for (size_t i = 0; i < inst->ports_count; ++i) {
+		auto port = inst->ports + i;
+
+		if (inst->port_table->types[i] != PORT_CONTROL)
 			continue;
 
 		suil_instance_port_event(this->ui_instance,
-					 port->index,
+					 i,
 					 sizeof(float),
 					 PROTOCOL_FLOAT,
 					 &port->value);
-
-		port->ui_value = port->value;
 	}
 }
 
 void LV2Plugin::show_ui()
 {
-	if (this->ui_window != nullptr && this->ui_instance != nullptr)
-		this->ui_window->show();
+	if (this->ui_window == nullptr || this->ui_instance == nullptr)
+		return;
+
+	this->ui_window->show();
+
+	/* what changed while nobody was looking */
+	this->ui_resync = true;
+	this->ui_listening = true;
+	GuiUpdateTimer::get()->add(this);
 }
 
 void LV2Plugin::hide_ui()
 {
-	if (this->ui_window != nullptr && this->ui_instance != nullptr)
-		this->ui_window->hide();
+	if (this->ui_window == nullptr || this->ui_instance == nullptr)
+		return;
+
+	this->ui_window->hide();
+
+	this->ui_listening = false;
+	GuiUpdateTimer::get()->remove(this);
 }
 
 bool LV2Plugin::is_ui_visible()
@@ -160,8 +273,15 @@ void LV2Plugin::cleanup_ui()
 	if (this->is_ui_visible())
 		this->hide_ui();
 
-	if (this->ui_window != nullptr)
+	this->ui_listening = false;
+	this->ui_idle = nullptr;
+
+	/* it may be registered even if it was closed by the window manager,
+	 * without a window it never was, and there may be no Qt at all */
+	if (this->ui_window != nullptr) {
+		GuiUpdateTimer::get()->remove(this);
 		this->ui_window->clearWidget();
+	}
 
 	if (this->ui_instance != nullptr) {
 		suil_instance_free(this->ui_instance);
@@ -169,26 +289,52 @@ void LV2Plugin::cleanup_ui()
 	}
 }
 
-void LV2Plugin::notify_ui_output_control_ports()
+bool LV2Plugin::update_ui(void)
 {
-	if (this->ui_instance == nullptr || this->ui_window == nullptr || !this->is_ui_visible())
-		return;
+	/* e.g. closed with the window's button */
+	if (this->ui_instance == nullptr || !this->is_ui_visible()) {
+		this->ui_listening = false;
+		return false;
+	}
 
-	for (size_t i = 0; i < this->ports_count; ++i) {
-		auto port = this->ports + i;
+	LV2Instance *inst = this->inst.load(std::memory_order_acquire);
 
-		if (port->type != PORT_CONTROL || port->is_input)
-			continue;
+	if (inst != nullptr)
+		deliver_ui_events(inst);
 
-		if (port->ui_value == port->value)
-			continue;
+	for (size_t w = 0; inst != nullptr && w < inst->dirty_words; ++w) {
+		uint64_t bits = inst->dirty[w].exchange(0, std::memory_order_acquire);
 
-		suil_instance_port_event(this->ui_instance,
-					 port->index,
-					 sizeof(float),
-					 PROTOCOL_FLOAT,
-					 &port->value);
+		while (bits != 0) {
+			uint32_t idx = w * 64 + __builtin_ctzll(bits);
+			float value = inst->output_values[idx].load(std::memory_order_relaxed);
+
+			bits &= bits - 1;
+
+			suil_instance_port_event(this->ui_instance,
+						 idx,
+						 sizeof(float),
+						 PROTOCOL_FLOAT,
+						 &value);
+		}
+	}
 
-		port->ui_value = port->value;
+	/* non-zero means the UI wants to be closed */
+	if (this->ui_idle != nullptr &&
+	    this->ui_idle->idle(suil_instance_get_handle(this->ui_instance)) != 0) {
+		hide_ui();
+		return false;
 	}
+
+	return true;
+}
+
+void LV2Plugin::set_ui_update_rate(float rate)
+{
+	this->ui_update_rate = std::max(1.0f, rate);
+}
+
+float LV2Plugin::get_ui_update_rate(void)
+{
+	return this->ui_update_rate;
 }
@@ -0,0 +1,211 @@
+/******************************************************************************
+ *   Copyright (C) 2020 by Arkadiusz Hiler
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+#include "obs-lv2.hpp"
+
+/* The writer never waits for the reader, when there's no room it drops the
+ * oldest events instead. Both move the head, so the reader takes an event
+ * only if the head is still where it was when it started copying - if the
+ * writer got there first the copy is thrown away and it tries the next one.
+ * The writer only ever overwrites what's behind the head. */
+EventRing::EventRing(size_t capacity) : ByteRing(capacity)
+{
+}
+
+/* an event is its total size, the port, the protocol and the data */
+#define EVENT_HEADER (3 * sizeof(uint32_t))
+
+bool EventRing::push(uint32_t port, uint32_t protocol, uint32_t size, const void *buf)
+{
+	size_t capacity = this->mask + 1;
+	uint32_t total = EVENT_HEADER + size;
+
+	if (total > capacity) {
+		this->dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	size_t tail = this->tail.load(std::memory_order_relaxed);
+	size_t head = this->head.load(std::memory_order_acquire);
+
+	while (tail - head + total > capacity) {
+		uint32_t oldest;
+		copy_out(head, &oldest, sizeof(oldest));
+
+		/* on failure the reader took it, head is reloaded either way */
+		if (this->head.compare_exchange_weak(head, head + oldest,
+						     std::memory_order_acq_rel))
+			this->dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	uint32_t header[3] = { total, port, protocol };
+
+	copy_in(tail, header, sizeof(header));
+	copy_in(tail + sizeof(header), buf, size);
+	this->tail.store(tail + total, std::memory_order_release);
+	this->pushed.fetch_add(1, std::memory_order_relaxed);
+
+	return true;
+}
+
+bool EventRing::pop(uint32_t *port, uint32_t *protocol, uint32_t *size,
+		    void *buf, size_t buf_size)
+{
+	for (;;) {
+		size_t head = this->head.load(std::memory_order_acquire);
+
+		if (head == this->tail.load(std::memory_order_acquire))
+			return false;
+
+		uint32_t header[3];
+		copy_out(head, header, sizeof(header));
+
+		/* torn by the writer, the CAS below fails */
+		uint32_t total = header[0];
+		bool fits = total >= EVENT_HEADER && total - EVENT_HEADER <= buf_size &&
+			total <= this->mask + 1;
+
+		if (fits)
+			copy_out(head + sizeof(header), buf, total - EVENT_HEADER);
+
+		if (!this->head.compare_exchange_strong(head, head + total,
+							std::memory_order_acq_rel))
+			continue;
+
+		*port = header[1];
+		*protocol = header[2];
+		*size = fits ? total - EVENT_HEADER : 0;
+
+		return true;
+	}
+}
+
+uint64_t EventRing::get_pushed(void)
+{
+	return this->pushed.load(std::memory_order_relaxed);
+}
+
+uint64_t EventRing::get_dropped(void)
+{
+	return this->dropped.load(std::memory_order_relaxed);
+}
+
+/* Audio thread, after the instance has run. The events of the atom output
+ * ports go to the UI as they are, as atom:eventTransfer. */
+void LV2Plugin::publish_atom_outputs(LV2Instance *inst)
+{
+	if (inst->ui_events == nullptr)
+		return;
+
+	for (size_t i = 0; i < inst->atom_ports_count; ++i) {
+		uint32_t idx = inst->atom_ports[i];
+		auto seq = inst->ports[idx].atom;
+
+		if (inst->port_table->is_input(idx) || !inst->ui_notify[idx])
+			continue;
+
+		/* a plugin with nothing to say may leave the chunk there */
+		if (seq->atom.type != this->urid_atom_sequence)
+			continue;
+
+		LV2_ATOM_SEQUENCE_FOREACH(seq, ev) {
+			inst->ui_events->push(idx,
+					      this->urid_atom_event_transfer,
+					      sizeof(LV2_Atom) + ev->body.size,
+					      &ev->body);
+		}
+	}
+}
+
+/* UI thread, see update_ui() */
+void LV2Plugin::deliver_ui_events(LV2Instance *inst)
+{
+	/* the other direction, see prepare_atom_ports() */
+	uint64_t atoms_dropped = inst->atom_events_dropped.load(std::memory_order_relaxed);
+
+	if (atoms_dropped != inst->atom_events_dropped_reported) {
+		WARN("the plugin's atom ports were full, %lu events from the UI dropped so far\n",
+		     (unsigned long) atoms_dropped);
+		inst->atom_events_dropped_reported = atoms_dropped;
+	}
+
+	if (inst->ui_events == nullptr)
+		return;
+
+	uint32_t port, protocol, size;
+
+	while (inst->ui_events->pop(&port, &protocol, &size, inst->ui_event, UI_EVENTS_RING_SIZE)) {
+		if (size == 0)
+			continue;
+
+		suil_instance_port_event(this->ui_instance, port, size, protocol, inst->ui_event);
+	}
+
+	uint64_t dropped = inst->ui_events->get_dropped();
+
+	if (dropped != inst->ui_events_dropped) {
+		WARN("the UI couldn't keep up, %lu of %lu events dropped so far\n",
+		     (unsigned long) dropped,
+		     (unsigned long) inst->ui_events->get_pushed());
+		inst->ui_events_dropped = dropped;
+	}
+}
+
+/* ui:portNotification, the ports the UI wants to hear about - all outputs if
+ * it doesn't say. Has to be set before the audio thread starts publishing. */
+void LV2Plugin::prepare_ui_notifications(LV2Instance *inst)
+{
+	auto world_guard = lv2_world->lock_world();
+
+	LilvNode *port_notification = lilv_new_uri(this->world, LV2_UI__portNotification);
+	LilvNode *port_index = lilv_new_uri(this->world, LV2_UI__portIndex);
+	LilvNode *symbol = lilv_new_uri(this->world, LV2_CORE__symbol);
+
+	auto notifications = lilv_world_find_nodes(this->world,
+						   lilv_ui_get_uri(this->ui),
+						   port_notification,
+						   nullptr);
+
+	bool all = notifications == nullptr || lilv_nodes_size(notifications) == 0;
+
+	for (size_t i = 0; i < inst->ports_count; ++i)
+		inst->ui_notify[i] = all;
+
+	LILV_FOREACH(nodes, i, notifications) {
+		auto notification = lilv_nodes_get(notifications, i);
+		uint32_t idx = LV2UI_INVALID_PORT_INDEX;
+
+		auto index = lilv_world_get(this->world, notification, port_index, nullptr);
+		auto sym = lilv_world_get(this->world, notification, symbol, nullptr);
+
+		if (index != nullptr && lilv_node_is_int(index))
+			idx = lilv_node_as_int(index);
+		else if (sym != nullptr && lilv_node_is_string(sym))
+			idx = inst->port_table->find(lilv_node_as_string(sym));
+
+		lilv_node_free(index);
+		lilv_node_free(sym);
+
+		if (idx < inst->ports_count)
+			inst->ui_notify[idx] = true;
+	}
+
+	lilv_nodes_free(notifications);
+	lilv_node_free(symbol);
+	lilv_node_free(port_index);
+	lilv_node_free(port_notification);
+}
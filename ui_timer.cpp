@@ -17,9 +17,32 @@
 
 #include "obs-lv2.hpp"
 
-GuiUpdateTimer::GuiUpdateTimer(LV2Plugin *lv2)
+/* A single timer for the whole module, on the Qt main thread. It runs only
+ * while there's a visible UI and as fast as the most demanding of them
+ * wants. Plugins can leave from any thread, the tick notices. */
+GuiUpdateTimer *GuiUpdateTimer::shared = nullptr;
+
+GuiUpdateTimer *GuiUpdateTimer::get(void)
+{
+	if (shared == nullptr)
+		shared = new GuiUpdateTimer();
+
+	return shared;
+}
+
+void GuiUpdateTimer::shutdown(void)
 {
-	this->lv2 = lv2;
+	delete shared;
+	shared = nullptr;
+}
+
+GuiUpdateTimer::GuiUpdateTimer()
+{
+	this->timer = new QTimer(this);
+	connect(timer,
+		&QTimer::timeout,
+		this,
+		QOverload<>::of(&GuiUpdateTimer::tick));
 }
 
 GuiUpdateTimer::~GuiUpdateTimer()
@@ -27,20 +50,53 @@ GuiUpdateTimer::~GuiUpdateTimer()
 	delete timer;
 }
 
-void GuiUpdateTimer::tick(void)
+/* Qt main thread only */
+void GuiUpdateTimer::add(LV2Plugin *lv2)
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+
+	this->plugins.insert(lv2);
+	reschedule();
+}
+
+void GuiUpdateTimer::remove(LV2Plugin *lv2)
 {
-	lv2->notify_ui_output_control_ports();
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+
+	this->plugins.erase(lv2);
 }
 
-void GuiUpdateTimer::start(void)
+void GuiUpdateTimer::reschedule(void)
 {
-	if (this->timer != nullptr)
+	if (this->plugins.empty()) {
+		this->timer->stop();
 		return;
+	}
 
-	this->timer = new QTimer(this);
-	connect(timer,
-		&QTimer::timeout,
-		this,
-		QOverload<>::of(&GuiUpdateTimer::tick));
-	timer->start(33); /* ~30 Hz */
+	float rate = 1.0f;
+
+	for (auto lv2: this->plugins)
+		rate = std::max(rate, lv2->get_ui_update_rate());
+
+	int interval = std::max(1, (int) (1000.0f / rate));
+
+	if (!this->timer->isActive() || this->timer->interval() != interval)
+		this->timer->start(interval);
+}
+
+void GuiUpdateTimer::tick(void)
+{
+	/* update_ui() may hide the UI, which leaves the set */
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	std::vector<LV2Plugin*> current(this->plugins.begin(), this->plugins.end());
+
+	for (auto lv2: current) {
+		if (this->plugins.count(lv2) == 0)
+			continue;
+
+		if (!lv2->update_ui())
+			this->plugins.erase(lv2);
+	}
+
+	reschedule();
 }
@@ -17,34 +17,108 @@
 
 #include "obs-lv2.hpp"
 
-LV2_URID LV2Plugin::urid_map(LV2_URID_Map_Handle handle, const char *uri)
+/* The URIs are interned once for the whole module and never forgotten, so a
+ * published entry never changes and can be read without any locking. Only
+ * adding a new one takes the lock - plugins map most of their URIs while
+ * being instantiated, after that it's all lookups. */
+UridTable::UridTable()
 {
-	LV2Plugin *lv2 = (LV2Plugin*)handle;
-	LV2_URID urid;
+	this->slots = new std::atomic<Entry*>[URID_TABLE_SIZE * 2];
+	this->uris = new std::atomic<const char*>[URID_TABLE_SIZE];
 
-	std::string key = uri;
+	for (size_t i = 0; i < URID_TABLE_SIZE * 2; ++i)
+		this->slots[i].store(nullptr, std::memory_order_relaxed);
 
-	if (lv2->urid_map_data.find(key) == lv2->urid_map_data.end()) {
-		urid = lv2->current_urid++;
-		lv2->urid_map_data[key] = urid;
-	} else {
-		urid = lv2->urid_map_data[key];
+	for (size_t i = 0; i < URID_TABLE_SIZE; ++i)
+		this->uris[i].store(nullptr, std::memory_order_relaxed);
+}
+
+UridTable::~UridTable()
+{
+	for (size_t i = 0; i < URID_TABLE_SIZE * 2; ++i) {
+		Entry *entry = this->slots[i].load(std::memory_order_relaxed);
+
+		if (entry != nullptr) {
+			free(entry->uri);
+			delete entry;
+		}
 	}
 
-	return urid;
+	delete[] this->slots;
+	delete[] this->uris;
 }
 
-const char *LV2Plugin::urid_unmap(void *handle, LV2_URID urid)
+/* the slot with the URI or the empty one where it would go, the table is
+ * twice the size of what it holds so there always is one */
+std::atomic<UridTable::Entry*> *UridTable::find(const char *uri, uint32_t hash)
 {
-	LV2Plugin *lv2 = (LV2Plugin*)handle;
-	const char *value = nullptr;
+	size_t mask = URID_TABLE_SIZE * 2 - 1;
 
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		Entry *entry = this->slots[i].load(std::memory_order_acquire);
 
-	for (auto const& p : lv2->urid_map_data) {
-		if (p.second == urid) {
-			value = p.first.c_str();
-		}
+		if (entry == nullptr)
+			return &this->slots[i];
+
+		if (entry->hash == hash && !strcmp(entry->uri, uri))
+			return &this->slots[i];
+	}
+}
+
+LV2_URID UridTable::map(const char *uri)
+{
+	uint32_t hash = hash_string(uri);
+	auto slot = find(uri, hash);
+	Entry *entry = slot->load(std::memory_order_acquire);
+
+	if (entry != nullptr)
+		return entry->urid;
+
+	std::lock_guard<std::mutex> guard(this->insert_lock);
+
+	/* someone may have been adding it or taken the slot meanwhile */
+	slot = find(uri, hash);
+	entry = slot->load(std::memory_order_relaxed);
+
+	if (entry != nullptr)
+		return entry->urid;
+
+	if (this->next_urid >= URID_TABLE_SIZE) {
+		WARN("out of URIDs, can't map %s\n", uri);
+		return 0;
 	}
 
-	return value;
+	entry = new Entry();
+	entry->uri = strdup(uri);
+	entry->hash = hash;
+	entry->urid = this->next_urid++;
+
+	/* unmap() has to see it before anyone can get the URID */
+	this->uris[entry->urid].store(entry->uri, std::memory_order_release);
+	slot->store(entry, std::memory_order_release);
+
+	return entry->urid;
+}
+
+const char *UridTable::unmap(LV2_URID urid)
+{
+	if (urid >= URID_TABLE_SIZE)
+		return nullptr;
+
+	return this->uris[urid].load(std::memory_order_acquire);
+}
+
+LV2_URID UridTable::lv2_map(LV2_URID_Map_Handle handle, const char *uri)
+{
+	return ((UridTable*) handle)->map(uri);
+}
+
+const char *UridTable::lv2_unmap(LV2_URID_Unmap_Handle handle, LV2_URID urid)
+{
+	return ((UridTable*) handle)->unmap(urid);
+}
+
+LV2_URID LV2Plugin::urid_map(const char *uri)
+{
+	return lv2_world->get_urids()->map(uri);
 }
@@ -0,0 +1,236 @@
+/******************************************************************************
+ *   Copyright (C) 2020 by Arkadiusz Hiler
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+#include "obs-lv2.hpp"
+
+using namespace std;
+
+/* BYTE RING */
+ByteRing::ByteRing(size_t capacity)
+{
+	size_t size = 1;
+
+	while (size < capacity)
+		size <<= 1;
+
+	this->data = (uint8_t*) calloc(size, 1);
+	this->mask = size - 1;
+}
+
+ByteRing::~ByteRing()
+{
+	free(this->data);
+}
+
+void ByteRing::copy_in(size_t pos, const void *src, size_t size)
+{
+	size_t off = pos & this->mask;
+	size_t first = min(size, this->mask + 1 - off);
+
+	memcpy(this->data + off, src, first);
+	memcpy(this->data, (const uint8_t*) src + first, size - first);
+}
+
+void ByteRing::copy_out(size_t pos, void *dst, size_t size)
+{
+	size_t off = pos & this->mask;
+	size_t first = min(size, this->mask + 1 - off);
+
+	memcpy(dst, this->data + off, first);
+	memcpy((uint8_t*) dst + first, this->data, size - first);
+}
+
+bool ByteRing::write(uint32_t size, const void *buf)
+{
+	size_t tail = this->tail.load(memory_order_relaxed);
+	size_t used = tail - this->head.load(memory_order_acquire);
+
+	if (used + sizeof(size) + size > this->mask + 1)
+		return false;
+
+	copy_in(tail, &size, sizeof(size));
+	copy_in(tail + sizeof(size), buf, size);
+	this->tail.store(tail + sizeof(size) + size, memory_order_release);
+
+	return true;
+}
+
+bool ByteRing::read(uint32_t *size, void *buf, size_t buf_size)
+{
+	size_t head = this->head.load(memory_order_relaxed);
+
+	if (head == this->tail.load(memory_order_acquire))
+		return false;
+
+	uint32_t msg_size;
+	copy_out(head, &msg_size, sizeof(msg_size));
+
+	/* can't happen with buf_size >= capacity, but better safe than
+	 * overflowing - the message is dropped */
+	bool fits = msg_size <= buf_size;
+
+	if (fits)
+		copy_out(head + sizeof(msg_size), buf, msg_size);
+
+	this->head.store(head + sizeof(msg_size) + msg_size, memory_order_release);
+
+	*size = fits ? msg_size : 0;
+
+	return true;
+}
+
+/* WORKER POOL */
+WorkerPool::WorkerPool(size_t threads)
+{
+	sem_init(&this->wakeup, 0, 0);
+
+	if (threads == 0)
+		threads = 1;
+
+	for (size_t i = 0; i < threads; ++i)
+		this->workers.push_back(thread(&WorkerPool::work, this));
+}
+
+WorkerPool::~WorkerPool()
+{
+	this->stopping = true;
+
+	for (size_t i = 0; i < this->workers.size(); ++i)
+		sem_post(&this->wakeup);
+
+	for (auto &worker: this->workers)
+		worker.join();
+
+	sem_destroy(&this->wakeup);
+}
+
+void WorkerPool::add(LV2Instance *inst)
+{
+	lock_guard<mutex> guard(this->lock);
+	this->instances.insert(inst);
+}
+
+/* no work() call for the instance is running once this returns */
+void WorkerPool::remove(LV2Instance *inst)
+{
+	{
+		lock_guard<mutex> guard(this->lock);
+		this->instances.erase(inst);
+	}
+
+	/* workers take it only while holding the lock above, so this just
+	 * waits for whatever is in flight */
+	lock_guard<mutex> work_guard(inst->work_lock);
+}
+
+/* called from the audio thread, sem_post() doesn't block */
+void WorkerPool::wake(LV2Instance *inst)
+{
+	inst->work_pending.store(true, memory_order_release);
+	sem_post(&this->wakeup);
+}
+
+LV2Instance *WorkerPool::claim(void)
+{
+	lock_guard<mutex> guard(this->lock);
+
+	for (auto inst: this->instances) {
+		if (!inst->work_pending.load(memory_order_acquire))
+			continue;
+
+		/* work() is never called concurrently for one instance, whoever
+		 * holds it now will look for more once it's done */
+		if (!inst->work_lock.try_lock())
+			continue;
+
+		if (inst->work_pending.exchange(false))
+			return inst;
+
+		inst->work_lock.unlock();
+	}
+
+	return nullptr;
+}
+
+void WorkerPool::work(void)
+{
+	vector<uint8_t> buf(WORKER_RING_SIZE);
+
+	for (;;) {
+		sem_wait(&this->wakeup);
+
+		if (this->stopping)
+			return;
+
+		while (auto inst = claim()) {
+			uint32_t size;
+			auto handle = lilv_instance_get_handle(inst->instance);
+
+			while (inst->worker_requests->read(&size, buf.data(), buf.size()))
+				inst->worker->work(handle, LV2Plugin::worker_respond,
+						   inst, size, buf.data());
+
+			inst->work_lock.unlock();
+		}
+	}
+}
+
+/* WORKER FEATURE */
+LV2_Worker_Status LV2Plugin::worker_schedule(LV2_Worker_Schedule_Handle handle,
+					     uint32_t size,
+					     const void *data)
+{
+	LV2Instance *inst = (LV2Instance*) handle;
+
+	if (inst->worker == nullptr)
+		return LV2_WORKER_ERR_UNKNOWN;
+
+	if (!inst->worker_requests->write(size, data))
+		return LV2_WORKER_ERR_NO_SPACE;
+
+	inst->workers->wake(inst);
+
+	return LV2_WORKER_SUCCESS;
+}
+
+LV2_Worker_Status LV2Plugin::worker_respond(LV2_Worker_Respond_Handle handle,
+					    uint32_t size,
+					    const void *data)
+{
+	LV2Instance *inst = (LV2Instance*) handle;
+
+	if (!inst->worker_responses->write(size, data))
+		return LV2_WORKER_ERR_NO_SPACE;
+
+	return LV2_WORKER_SUCCESS;
+}
+
+/* from whoever runs the instance, right after run() */
+void LV2Plugin::deliver_worker_responses(LV2Instance *inst)
+{
+	if (inst->worker == nullptr)
+		return;
+
+	uint32_t size;
+	auto handle = lilv_instance_get_handle(inst->instance);
+
+	while (inst->worker_responses->read(&size, inst->worker_response, WORKER_RING_SIZE))
+		inst->worker->work_response(handle, size, inst->worker_response);
+
+	if (inst->worker->end_run != nullptr)
+		inst->worker->end_run(handle);
+}
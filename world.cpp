@@ -0,0 +1,528 @@
+/******************************************************************************
+ *   Copyright (C) 2020 by Arkadiusz Hiler
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+#include "obs-lv2.hpp"
+#include <dlfcn.h>
+
+using namespace std;
+
+/* has to be kept in sync with what LV2Plugin puts in its features[] */
+static const char *supported_features[] = {
+	LV2_URID_MAP_URI,
+	LV2_URID_UNMAP_URI,
+	LV2_INSTANCE_ACCESS_URI,
+	LV2_DATA_ACCESS_URI,
+	LV2_CORE__inPlaceBroken, /* not a feature[], we just copy for those */
+	LV2_WORKER__schedule, /* per instance, see LV2Instance::features */
+	LV2_OPTIONS__options,
+	LV2_BUF_SIZE__boundedBlockLength,
+	nullptr, /* NULL terminated */
+};
+
+LV2World *LV2World::shared = nullptr;
+size_t LV2World::refcount = 0;
+mutex LV2World::refcount_lock;
+
+LV2World *LV2World::acquire(void)
+{
+	lock_guard<mutex> guard(refcount_lock);
+
+	if (shared == nullptr)
+		shared = new LV2World();
+
+	refcount++;
+
+	return shared;
+}
+
+void LV2World::release(void)
+{
+	lock_guard<mutex> guard(refcount_lock);
+
+	if (shared == nullptr || refcount == 0) {
+		printf("releasing LV2 world that was never acquired!\n");
+		return;
+	}
+
+	if (--refcount == 0) {
+		delete shared;
+		shared = nullptr;
+	}
+}
+
+LV2World::LV2World() : tasks(thread::hardware_concurrency()),
+			 workers(WORKER_THREADS),
+			 dsp_pool(thread::hardware_concurrency())
+{
+	world = lilv_world_new();
+	plugins = lilv_world_get_all_plugins(world);
+
+	/* nothing gets loaded here, bundles are loaded as the filters ask for
+	 * their plugins and the full scan runs on a separate world */
+	load_catalog_cache(this->bundle_mtimes, this->catalog);
+}
+
+LV2World::~LV2World()
+{
+	this->scan_abort = true;
+
+	if (this->scan_thread.joinable())
+		this->scan_thread.join();
+
+	lilv_world_free(world);
+}
+
+LilvWorld *LV2World::get_world(void)
+{
+	return this->world;
+}
+
+unique_lock<mutex> LV2World::lock_world(void)
+{
+	return unique_lock<mutex>(this->world_lock);
+}
+
+TaskPool *LV2World::get_tasks(void)
+{
+	return &this->tasks;
+}
+
+WorkerPool *LV2World::get_workers(void)
+{
+	return &this->workers;
+}
+
+DspPool *LV2World::get_dsp_pool(void)
+{
+	return &this->dsp_pool;
+}
+
+UridTable *LV2World::get_urids(void)
+{
+	return &this->urids;
+}
+
+void LV2World::load_bundle(const string &path)
+{
+	if (this->loaded_bundles.find(path) != this->loaded_bundles.end())
+		return;
+
+	auto bundle_uri = lilv_new_file_uri(this->world, NULL, path.c_str());
+	lilv_world_load_bundle(this->world, bundle_uri);
+	lilv_node_free(bundle_uri);
+
+	this->loaded_bundles.insert(path);
+}
+
+bool LV2World::load_plugin_bundles(const char *uri)
+{
+	unique_lock<mutex> guard(this->catalog_lock);
+
+	auto info = this->catalog.find(uri);
+	if (info == this->catalog.end())
+		return false;
+
+	auto bundle = info->second.bundle;
+	auto dependencies = info->second.dependencies;
+	guard.unlock();
+
+	load_bundle(bundle);
+
+	for (auto const& dep: dependencies)
+		load_bundle(dep);
+
+	return true;
+}
+
+const LilvPlugin *LV2World::get_plugin(const char *uri)
+{
+	if (uri == nullptr)
+		return nullptr;
+
+	auto world_guard = lock_world();
+
+	auto plugin_uri = lilv_new_uri(this->world, uri);
+	auto plugin = lilv_plugins_get_by_uri(this->plugins, plugin_uri);
+
+	/* try to load only what's needed for this one plugin first */
+	if (plugin == nullptr && load_plugin_bundles(uri))
+		plugin = lilv_plugins_get_by_uri(this->plugins, plugin_uri);
+
+	/* not in the cache or the cache is stale, wait for the scan */
+	if (plugin == nullptr && !is_catalog_ready()) {
+		world_guard.unlock();
+		wait_for_catalog();
+		world_guard.lock();
+
+		if (load_plugin_bundles(uri))
+			plugin = lilv_plugins_get_by_uri(this->plugins, plugin_uri);
+	}
+
+	lilv_node_free(plugin_uri);
+
+	return plugin;
+}
+
+struct LV2Library
+{
+	void *handle;
+	const LV2_Lib_Descriptor *descriptor;
+};
+
+static void close_library(LV2Library *lib)
+{
+	if (lib->descriptor != nullptr && lib->descriptor->cleanup != nullptr)
+		lib->descriptor->cleanup(lib->descriptor->handle);
+
+	if (lib->handle != nullptr)
+		dlclose(lib->handle);
+
+	delete lib;
+}
+
+/* Does what lilv_plugin_instantiate() does, but holds the world lock only
+ * for the lookups - instantiating some plugins takes hundreds of milliseconds
+ * and we want to do many of them at once. The result is a regular
+ * LilvInstance, but it has to be freed with free_instance(). */
+LilvInstance *LV2World::instantiate(const LilvPlugin *plugin,
+				    double sample_rate,
+				    const LV2_Feature *const *features)
+{
+	auto world_guard = lock_world();
+
+	auto lib_uri = lilv_plugin_get_library_uri(plugin);
+	auto bundle_uri = lilv_plugin_get_bundle_uri(plugin);
+
+	if (lib_uri == nullptr || bundle_uri == nullptr)
+		return nullptr;
+
+	char *lib_path = lilv_file_uri_parse(lilv_node_as_uri(lib_uri), NULL);
+	char *bundle_path = lilv_file_uri_parse(lilv_node_as_uri(bundle_uri), NULL);
+	string uri = lilv_node_as_uri(lilv_plugin_get_uri(plugin));
+
+	world_guard.unlock();
+
+	LilvInstance *instance = nullptr;
+	LV2Library *lib = new LV2Library();
+	lib->handle = dlopen(lib_path, RTLD_NOW);
+	lib->descriptor = nullptr;
+
+	if (lib->handle == nullptr)
+		printf("failed to open %s: %s\n", lib_path, dlerror());
+
+	LV2_Lib_Descriptor_Function lib_func = nullptr;
+	LV2_Descriptor_Function func = nullptr;
+
+	if (lib->handle != nullptr) {
+		lib_func = (LV2_Lib_Descriptor_Function) dlsym(lib->handle, "lv2_lib_descriptor");
+		func = (LV2_Descriptor_Function) dlsym(lib->handle, "lv2_descriptor");
+	}
+
+	if (lib_func != nullptr)
+		lib->descriptor = lib_func(bundle_path, features);
+
+	for (uint32_t i = 0; lib->descriptor != nullptr || func != nullptr; ++i) {
+		const LV2_Descriptor *desc;
+
+		if (lib->descriptor != nullptr)
+			desc = lib->descriptor->get_plugin(lib->descriptor->handle, i);
+		else
+			desc = func(i);
+
+		if (desc == nullptr)
+			break;
+
+		if (uri != desc->URI)
+			continue;
+
+		auto handle = desc->instantiate(desc, sample_rate, bundle_path, features);
+		if (handle == nullptr)
+			break;
+
+		instance = (LilvInstance*) malloc(sizeof(*instance));
+		instance->lv2_descriptor = desc;
+		instance->lv2_handle = handle;
+		instance->pimpl = lib;
+		break;
+	}
+
+	if (instance == nullptr)
+		close_library(lib);
+
+	lilv_free(bundle_path);
+	lilv_free(lib_path);
+
+	return instance;
+}
+
+void LV2World::free_instance(LilvInstance *instance)
+{
+	if (instance == nullptr)
+		return;
+
+	instance->lv2_descriptor->cleanup(instance->lv2_handle);
+	close_library((LV2Library*) instance->pimpl);
+	free(instance);
+}
+
+void LV2World::start_scan(void)
+{
+	lock_guard<mutex> guard(this->catalog_lock);
+
+	if (this->scan_thread.joinable())
+		return;
+
+	this->scan_thread = thread(&LV2World::scan, this);
+}
+
+void LV2World::set_catalog_ready_callback(function<void(void)> f)
+{
+	lock_guard<mutex> guard(this->catalog_lock);
+
+	this->catalog_ready_callback = f;
+}
+
+bool LV2World::is_catalog_ready(void)
+{
+	lock_guard<mutex> guard(this->catalog_lock);
+
+	return this->catalog_ready;
+}
+
+void LV2World::wait_for_catalog(void)
+{
+	start_scan();
+
+	unique_lock<mutex> guard(this->catalog_lock);
+	this->catalog_ready_cond.wait(guard, [this] { return this->catalog_ready; });
+}
+
+/* Runs on its own thread with a private world, so the shared one only ever
+ * holds the bundles the filters use and is never blocked by the scan. */
+void LV2World::scan(void)
+{
+	auto scan_world = lilv_world_new();
+	lilv_world_load_all(scan_world);
+
+	populate_catalog(scan_world);
+
+	lilv_world_free(scan_world);
+
+	function<void(void)> callback;
+	{
+		lock_guard<mutex> guard(this->catalog_lock);
+		this->catalog_ready = true;
+		callback = this->catalog_ready_callback;
+	}
+
+	this->catalog_ready_cond.notify_all();
+
+	if (callback)
+		callback();
+}
+
+bool LV2World::is_feature_supported(const char *uri)
+{
+	for (auto feature = supported_features; *feature != nullptr; feature++) {
+		if (0 == strcmp(*feature, uri))
+			return true;
+	}
+
+	return false;
+}
+
+LV2PluginInfo LV2World::probe_plugin(LilvWorld *scan_world,
+				     const LilvPlugin *plugin,
+				     const string &bundle)
+{
+	LilvNode* input_port  = lilv_new_uri(scan_world, LV2_CORE__InputPort);
+	LilvNode* output_port = lilv_new_uri(scan_world, LV2_CORE__OutputPort);
+	LilvNode* audio_port  = lilv_new_uri(scan_world, LV2_CORE__AudioPort);
+	LilvNode* qt5_uri     = lilv_new_uri(scan_world, LV2_UI__Qt5UI);
+
+	LV2PluginInfo info;
+
+	auto name = lilv_plugin_get_name(plugin);
+	info.name = lilv_node_as_string(name);
+	lilv_node_free(name);
+
+	info.uri = lilv_node_as_uri(lilv_plugin_get_uri(plugin));
+	info.bundle = bundle;
+
+	/* whether we support them is decided when the catalog is queried, so
+	 * the cache survives us learning new features */
+	auto req_features = lilv_plugin_get_required_features(plugin);
+	LILV_FOREACH(nodes, j, req_features) {
+		const LilvNode* feature = lilv_nodes_get(req_features, j);
+		info.required_features.push_back(lilv_node_as_uri(feature));
+	}
+	lilv_nodes_free(req_features);
+
+	info.has_ui = false;
+	auto uis = lilv_plugin_get_uis(plugin);
+	LILV_FOREACH(uis, i, uis) {
+		const LilvNode *ui_type;
+		auto ui = lilv_uis_get(uis, i);
+
+		if (lilv_ui_is_supported(ui, suil_ui_supported,
+					 qt5_uri,
+					 &ui_type)) {
+			info.has_ui = true;
+		}
+	}
+	lilv_uis_free(uis);
+
+	info.audio_inputs = lilv_plugin_get_num_ports_of_class(plugin, audio_port, input_port, NULL);
+	info.audio_outputs = lilv_plugin_get_num_ports_of_class(plugin, audio_port, output_port, NULL);
+
+	lilv_node_free(qt5_uri);
+	lilv_node_free(audio_port);
+	lilv_node_free(output_port);
+	lilv_node_free(input_port);
+
+	return info;
+}
+
+static string bundle_of_file(const char *file_uri)
+{
+	char *path = lilv_file_uri_parse(file_uri, NULL);
+	string bundle = path;
+	lilv_free(path);
+
+	return bundle.substr(0, bundle.rfind('/') + 1);
+}
+
+/* Plugin data is parsed lazily by lilv, so for the bundles that did not
+ * change since the cache was written we never touch anything beyond the
+ * manifests lilv_world_load_all() has already read. */
+void LV2World::populate_catalog(LilvWorld *scan_world)
+{
+	auto scan_plugins = lilv_world_get_all_plugins(scan_world);
+	map<string,LV2PluginInfo> cached_catalog;
+	map<string,int64_t> cached_bundles;
+	map<string,LV2PluginInfo> catalog;
+	map<string,int64_t> bundles;
+	size_t rescanned = 0;
+
+	auto mtime = [&](const string &bundle) {
+		if (bundles.find(bundle) == bundles.end())
+			bundles[bundle] = bundle_mtime(bundle);
+
+		return bundles[bundle];
+	};
+
+	{
+		lock_guard<mutex> guard(this->catalog_lock);
+		cached_catalog = this->catalog;
+		cached_bundles = this->bundle_mtimes;
+	}
+
+	auto unchanged = [&](const string &bundle) {
+		auto cached = cached_bundles.find(bundle);
+
+		return cached != cached_bundles.end() &&
+		       cached->second == mtime(bundle);
+	};
+
+	LILV_FOREACH(plugins, i, scan_plugins) {
+		auto plugin = lilv_plugins_get(scan_plugins, i);
+		string uri = lilv_node_as_uri(lilv_plugin_get_uri(plugin));
+
+		/* the data of a plugin can be spread over multiple bundles,
+		 * e.g. UIs shipped separately, all of them are dependencies */
+		string bundle = bundle_of_file(lilv_node_as_uri(lilv_plugin_get_bundle_uri(plugin)));
+		vector<string> dependencies;
+
+		auto data_uris = lilv_plugin_get_data_uris(plugin);
+		LILV_FOREACH(nodes, j, data_uris) {
+			auto dep = bundle_of_file(lilv_node_as_uri(lilv_nodes_get(data_uris, j)));
+
+			if (dep != bundle && find(dependencies.begin(), dependencies.end(), dep) == dependencies.end())
+				dependencies.push_back(dep);
+		}
+
+		if (this->scan_abort)
+			return;
+
+		auto cached = cached_catalog.find(uri);
+
+		bool fresh = cached != cached_catalog.end() &&
+			     cached->second.bundle == bundle &&
+			     cached->second.dependencies == dependencies &&
+			     unchanged(bundle);
+
+		for (auto const& dep: dependencies)
+			fresh = unchanged(dep) && fresh;
+
+		if (fresh) {
+			catalog[uri] = cached->second;
+			continue;
+		}
+
+		catalog[uri] = probe_plugin(scan_world, plugin, bundle);
+		catalog[uri].dependencies = dependencies;
+		rescanned++;
+	}
+
+	printf("LV2 catalog has %zu plugins, %zu (re)scanned\n",
+	       catalog.size(), rescanned);
+
+	bool changed = rescanned > 0 || bundles != cached_bundles ||
+		       catalog.size() != cached_catalog.size();
+
+	lock_guard<mutex> guard(this->catalog_lock);
+	this->catalog = catalog;
+	this->bundle_mtimes = bundles;
+
+	if (changed)
+		save_catalog_cache();
+}
+
+bool LV2World::is_plugin_supported(const LV2PluginInfo &info)
+{
+	for (auto const& f: info.required_features) {
+		if (!is_feature_supported(f.c_str()))
+			return false;
+	}
+
+	if (!info.has_ui)
+		return false;
+
+	/* with fewer ports than channels it gets a copy per group of them,
+	 * see LV2Plugin::create_instance() */
+	if (info.audio_inputs == 0 || info.audio_outputs == 0)
+		return false;
+
+	return true;
+}
+
+bool LV2World::for_each_supported_plugin(function<void(const char *, const char *)> f)
+{
+	start_scan();
+
+	lock_guard<mutex> guard(this->catalog_lock);
+
+	/* until the scan is done this lists what the cache had */
+	for (auto const& p: this->catalog) {
+		if (!is_plugin_supported(p.second))
+			continue;
+
+		f(p.second.name.c_str(), p.second.uri.c_str());
+	}
+
+	return this->catalog_ready;
+}